@@ -27,12 +27,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <math.h>
 #include <alsa/asoundlib.h>
 #define DLS_SYNTHESIZER 1
 #include <eas.h>
@@ -40,48 +49,404 @@
 #include <eas_chorus.h>
 
 
+#define EVENT_BUFFER_SIZE 65536
+#define CACHE_LINE_SIZE 64
+#define COALESCE_MAX_EVENTS 512
+// 128 controllers + channel pressure + pitch bend for each channel
+#define COALESCE_KEY_CHANNEL_PRESSURE 128
+#define COALESCE_KEY_PITCH_BEND 129
+#define COALESCE_NUM_KEYS (16 * 130)
+// space in event ring reserved for events releasing notes (when dropping note on events)
+#define EVENT_RESERVE_SIZE (EVENT_BUFFER_SIZE / 4)
+#define SPILL_BUFFER_SIZE (1024 * 1024)
+#define RESAMPLER_MAX_PHASES 4096
+#define MAX_ENGINES 16
+#define MAX_PORTS 16
+#define MAX_PCM_DEVICES 8
+// duration of each latency probe step
+#define PROBE_SECONDS 5
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+enum {
+    OVERFLOW_DROP = 0,
+    OVERFLOW_BLOCK,
+    OVERFLOW_SPILL,
+    OVERFLOW_DROP_NOTE_ON
+};
+
+// notes held by a sender (only accessed by midi thread)
+typedef struct {
+    uint64_t notes[MAX_PORTS][16][2];   // bitmap of held notes for each input and channel
+    uint16_t sustain[MAX_PORTS];        // channels with pressed sustain pedal for each input
+    unsigned int num_held;              // number of held notes and pressed pedals
+    uint64_t last_event_time;
+} sender_notes_t;
+
+// state of synth instance (midi input with its engines)
+enum {
+    INPUT_UNUSED = 0,   // engines are not initialized
+    INPUT_FREE,         // ready in the pool
+    INPUT_ACTIVE,       // events are rendered
+    INPUT_RELEASED,     // client detached, render thread discards remaining events
+    INPUT_RECYCLING     // engines are being reset by pool thread
+};
+
+enum {
+    EVENT_CLASS_NORMAL = 0,
+    EVENT_CLASS_NOTE_ON,
+    EVENT_CLASS_RELEASE     // note off, pedal release, channel mode messages
+};
+
+
 typedef struct {
     uint8_t *dls_address;
     int dls_size;
 } dls_file_handle_t;
 
+typedef struct {
+    int policy;
+    int priority;       // -1 = default priority
+    int use_affinity;
+    cpu_set_t affinity;
+} thread_sched_t;
+
+// polyphase resampler from EAS sample rate to pcm sample rate
+typedef struct {
+    int active;
+    unsigned int up, down;      // resampling ratio (pcm rate / EAS rate) in lowest terms
+    unsigned int taps;          // filter taps per phase (multiple of 4)
+    unsigned int phase;         // filter phase of next output frame
+    unsigned int position;      // index of newest input frame used by next output frame
+    unsigned int max_output;    // maximal number of output frames from one block
+    float *coefs;               // taps coefficients for each phase (in reverse order)
+    float *input;               // input frames for each channel (taps - 1 previous frames + one block)
+    float *output;              // interleaved output frames
+} resampler_t;
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v4sf_unaligned __attribute__((vector_size(16), aligned(4)));
+typedef int16_t v4hi __attribute__((vector_size(8), aligned(2)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int32_t v4si_unaligned __attribute__((vector_size(16), aligned(4)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+
+// EAS instance - when using multiple engines, each one is rendered by its own worker thread
+typedef struct {
+    EAS_DATA_HANDLE data_handle;
+    EAS_HANDLE stream_handle[MAX_PORTS];
+    uint8_t emitted_status[MAX_PORTS];  // running status of events passed to each midi stream
+    EAS_PCM *buffer;            // rendered block (used when mixing engines)
+    unsigned int active_notes;  // number of sounding notes (when distributing voices)
+    // silence detection (only accessed by render thread)
+    uint64_t held_notes[MAX_PORTS][16][2];  // bitmap of held notes for each midi stream and channel
+    uint16_t sustain[MAX_PORTS];    // channels with pressed sustain pedal in each midi stream
+    unsigned int num_held;      // number of held notes and pressed pedals
+    unsigned int silent_blocks; // number of consecutive silent blocks without held notes
+    int idle;                   // engine is not rendered until it receives an event
+    pthread_t thread;
+    sem_t render_start, render_done;
+    int render_result;
+} synth_engine_t;
+
+// passed to started thread
+typedef struct {
+    volatile int initialized;
+    void *arg;
+} thread_start_t;
+
+// parameter of sched_setattr syscall (not defined in older C libraries)
+typedef struct {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+} deadline_sched_attr_t;
+
+// every event in the event ring is preceded by this header
+typedef struct {
+    uint64_t time;      // arrival time (nanoseconds of monotonic clock)
+    uint32_t length;    // length of event data following the header
+} event_header_t;
+
+// single-producer (midi thread) / single-consumer (render loop) event ring
+// indices are free-running and are masked when accessing the buffer
+typedef struct {
+    // producer side
+    _Alignas(CACHE_LINE_SIZE) atomic_uint write_index;
+    unsigned int pending_index; // end of written, but not yet published events
+    unsigned int cached_read_index;
+    uint8_t write_status;       // running status of events written to the ring
+    // consumer side
+    _Alignas(CACHE_LINE_SIZE) atomic_uint read_index;
+    unsigned int cached_write_index;
+    uint8_t read_status;        // running status of events in the ring
+    int16_t last_event[COALESCE_NUM_KEYS]; // last event with given key in currently coalesced events
+
+    _Alignas(CACHE_LINE_SIZE) uint8_t buffer[EVENT_BUFFER_SIZE];
+} event_ring_t;
+
+// events which didn't fit into the event ring (only accessed by midi thread)
+typedef struct {
+    uint8_t *buffer;
+    unsigned int read_offset, write_offset;
+} spill_buffer_t;
+
+// events from each sequencer port are passed through own event ring to own midi stream
+typedef struct {
+    int port_id;
+    event_ring_t *ring;
+    spill_buffer_t spill;
+    int first_engine;           // engines rendering events from the port
+    int stream;                 // index of midi stream in the engines
+    atomic_int state;
+    int client;                 // client using the synth instance (when isolating clients), or -1
+    int subscriptions;
+    // voice distribution state (only accessed by render thread)
+    int8_t note_engine[16][128];    // engine playing each note, or -1
+    uint8_t note_sustained[16][128];
+    uint8_t channel_sustain[16];
+} midi_input_t;
+
+// statistics counters are written by a single thread and can be read by any thread
+typedef struct {
+    atomic_ulong events_dropped;
+    atomic_ulong note_ons_dropped;
+    atomic_ulong producer_blocked;
+    atomic_ulong events_spilled;
+    atomic_ulong spill_max_bytes;
+    atomic_ulong xruns;
+    atomic_ulong render_margin;
+    atomic_ulong resampler_time;    // nanoseconds
+    atomic_ulong resampled_frames;
+    atomic_ulong blocks_skipped;    // blocks which weren't rendered, because all engines were idle
+    atomic_ulong render_ahead_empty;    // render thread had to wait for render-ahead worker
+    atomic_ulong batches;           // pcm writes of batched blocks
+    atomic_ulong batched_blocks;
+} statistics_t;
+
 
 static const char midi_name[] = "Sonivox EAS";
 static const char port_name[] = "Sonivox EAS port";
 
 static snd_seq_t *midi_seq;
-static int midi_port_id;
-static pthread_t midi_thread;
+static pthread_t midi_thread, render_thread, render_ahead_thread;
 static snd_pcm_t *midi_pcm;
+// pcm devices tried in the given order, index of the opened device
+static const char *pcm_devices[MAX_PCM_DEVICES];
+static int num_pcm_devices, pcm_device_index;
+static const char *seq_device;
+// file written by latency probe, file with latency configuration loaded at startup
+static const char *probe_filepath, *latency_filepath;
+static volatile int probe_result;
 static volatile int midi_init_state;
-static volatile int midi_event_written;
+static atomic_int midi_event_written;
+static int event_fd, signal_fd;
 
-static int polyphony, master_volume, daemonize;
+static int polyphony, master_volume, daemonize, event_timing, coalesce_events, overflow_policy;
 static int reverb_preset, reverb_wet;
 static int chorus_preset, chorus_rate, chorus_depth, chorus_level;
 static const char *dls_filepath;
-
-static EAS_DATA_HANDLE data_handle;
-static EAS_HANDLE stream_handle;
+static thread_sched_t midi_sched, render_sched;
+static cpu_set_t worker_cpus;
+static int use_worker_cpus;
+static int latency_ms, latency_periods, margin_ms, adaptive_margin, adaptive_decay, use_mmap, src_quality;
+
+static synth_engine_t engines[MAX_ENGINES];
+static int num_engines, engine_polyphony, distribute_voices;
+// peak level of silent block (-1 = always render), number of silent blocks before engine becomes idle
+static int skip_silence;
+static unsigned int idle_blocks;
+// number of engines rendering events from one port
+static int engines_per_input;
+// engine rendering each midi channel (relative to the first engine of the port)
+static int channel_map[16];
+static int num_inputs, separate_port_engines, streams_per_engine, isolate_clients;
+static midi_input_t inputs[MAX_PORTS];
+// pool of free synth instances (when isolating clients)
+static int pool_size;
+static int free_inputs[MAX_PORTS], num_free_inputs;
+static int8_t client_input[256];
+// clients whose events were dropped (reported only once)
+static uint8_t refused_clients[256];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t pool_sem;
+static pthread_t pool_thread;
+static sender_notes_t *sender_notes[256];
+static int note_timeout;
+// close pcm device after this many seconds without events (0 = never)
+static int close_timeout;
+static uint64_t last_timeout_check;
 
 static unsigned int frequency, num_channels, bytes_per_call, samples_per_call, num_subbuffers, subbuf_counter;
 static uint8_t midi_buffer[65536];
+// number of blocks rendered ahead by render-ahead worker (0 = render in render thread),
+// subbuffers of midi_buffer are used as a ring of rendered blocks
+static int render_ahead;
+// render and write all blocks which fit into pcm buffer at once
+static int batch_blocks;
+static sem_t render_ahead_free, render_ahead_ready;
+
+static statistics_t stats;
+static unsigned int pcm_rate, pcm_buffer_size, pcm_period_size;
+// number of pcm frames (at pcm rate) rendered in one block
+static unsigned int block_frames;
+static resampler_t resampler;
+// sample format of pcm device (EAS renders S16), size of one pcm frame in bytes
+static snd_pcm_format_t pcm_format, preferred_format;
+static unsigned int pcm_frame_size;
+static int use_dither;
+static v4su dither_state = { 0x12345678, 0x9ABCDEF1, 0x2468ACE1, 0x13579BDF };
+// converted (or resampled) frames of all subbuffers
+static uint8_t *pcm_output_buffer;
+static int pcm_mmap, mmap_pending;
+// hw params negotiated when opening pcm device, they're used when reopening the device
+static snd_pcm_hw_params_t *pcm_hwparams_saved;
+static snd_pcm_uframes_t mmap_offset;
+// amount of audio data (in frames) kept in pcm buffer ahead of playback position
+static unsigned int render_margin;
+// number of available frames in pcm buffer, when the next block is rendered
+static unsigned int render_threshold;
+
+#if defined(CLOCK_MONOTONIC_RAW)
+static clockid_t monotonic_clock_id;
+#define MONOTONIC_CLOCK_TYPE monotonic_clock_id
+#else
+#define MONOTONIC_CLOCK_TYPE CLOCK_MONOTONIC
+#endif
+
+
+static void select_monotonic_clock(void)
+{
+#if defined(CLOCK_MONOTONIC_RAW)
+    struct timespec current_time;
+
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &current_time))
+    {
+        monotonic_clock_id = CLOCK_MONOTONIC;
+    }
+    else
+    {
+        monotonic_clock_id = CLOCK_MONOTONIC_RAW;
+    }
+#endif
+}
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec current_time;
+
+    clock_gettime(MONOTONIC_CLOCK_TYPE, &current_time);
+    return current_time.tv_sec * (uint64_t)1000000000 + current_time.tv_nsec;
+}
+
+static void stat_add(atomic_ulong *counter, unsigned long value)
+{
+    // counters have single writer, so atomic read-modify-write is not necessary
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void stat_max(atomic_ulong *counter, unsigned long value)
+{
+    if (value > atomic_load_explicit(counter, memory_order_relaxed))
+    {
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+    }
+}
+
+static void print_statistics(void)
+{
+    printf("Statistics:\n");
+    printf("  events dropped: %lu\n", atomic_load_explicit(&stats.events_dropped, memory_order_relaxed));
+    printf("  note on events dropped: %lu\n", atomic_load_explicit(&stats.note_ons_dropped, memory_order_relaxed));
+    printf("  midi thread blocked: %lu\n", atomic_load_explicit(&stats.producer_blocked, memory_order_relaxed));
+    printf("  events spilled: %lu\n", atomic_load_explicit(&stats.events_spilled, memory_order_relaxed));
+    printf("  max spill buffer usage: %lu\n", atomic_load_explicit(&stats.spill_max_bytes, memory_order_relaxed));
+    printf("  buffer underruns: %lu\n", atomic_load_explicit(&stats.xruns, memory_order_relaxed));
+    printf("  render margin: %lu\n", atomic_load_explicit(&stats.render_margin, memory_order_relaxed));
+    printf("  silent blocks skipped: %lu\n", atomic_load_explicit(&stats.blocks_skipped, memory_order_relaxed));
+    if (batch_blocks)
+    {
+        unsigned long batches;
 
-static uint8_t event_buffer[65536];
-static volatile int event_read_index;
-static volatile int event_write_index;
+        batches = atomic_load_explicit(&stats.batches, memory_order_relaxed);
+        printf("  blocks per batch: %.2f\n", (batches == 0) ? 0.0 : atomic_load_explicit(&stats.batched_blocks, memory_order_relaxed) / (double)batches);
+    }
+    if (render_ahead > 0)
+    {
+        printf("  render-ahead ring empty: %lu\n", atomic_load_explicit(&stats.render_ahead_empty, memory_order_relaxed));
+    }
+    if (resampler.active)
+    {
+        unsigned long resampled_frames;
 
+        resampled_frames = atomic_load_explicit(&stats.resampled_frames, memory_order_relaxed);
+        printf("  resampler CPU usage: %.2f%%\n", (resampled_frames == 0) ? 0.0 : (atomic_load_explicit(&stats.resampler_time, memory_order_relaxed) * (pcm_rate / 1e7)) / resampled_frames);
+    }
+    fflush(stdout);
+}
 
-static void set_thread_scheduler(void) __attribute__((noinline));
-static void set_thread_scheduler(void)
+static void set_thread_scheduler(const thread_sched_t *sched, const char *thread_name) __attribute__((noinline));
+static void set_thread_scheduler(const thread_sched_t *sched, const char *thread_name)
 {
     struct sched_param param;
+    deadline_sched_attr_t attr;
+    int min_priority, max_priority;
+
+    if (sched->use_affinity && sched->policy == SCHED_DEADLINE)
+    {
+        // kernel refuses deadline scheduler for threads with restricted affinity
+        fprintf(stderr, "CPU affinity of %s thread is ignored with deadline scheduler\n", thread_name);
+    }
+    else if (sched->use_affinity)
+    {
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &(sched->affinity)) < 0)
+        {
+            fprintf(stderr, "Error setting CPU affinity of %s thread: %i\n", thread_name, errno);
+        }
+    }
 
-    memset(&param, 0, sizeof(struct sched_param));
-    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
-    if (param.sched_priority > 0)
+    switch (sched->policy)
     {
-        sched_setscheduler(0, SCHED_FIFO, &param);
+        case SCHED_FIFO:
+        case SCHED_RR:
+            min_priority = sched_get_priority_min(sched->policy);
+            max_priority = sched_get_priority_max(sched->policy);
+
+            memset(&param, 0, sizeof(struct sched_param));
+            param.sched_priority = (sched->priority < 0) ? min_priority : sched->priority;
+            if (param.sched_priority < min_priority) param.sched_priority = min_priority;
+            if (param.sched_priority > max_priority) param.sched_priority = max_priority;
+
+            if (param.sched_priority > 0)
+            {
+                sched_setscheduler(0, sched->policy, &param);
+            }
+            break;
+
+        case SCHED_DEADLINE:
+            // period is the duration of one render block, the thread can run for half of it
+            memset(&attr, 0, sizeof(deadline_sched_attr_t));
+            attr.size = sizeof(deadline_sched_attr_t);
+            attr.sched_policy = SCHED_DEADLINE;
+            attr.sched_period = (samples_per_call * (uint64_t)1000000000) / frequency;
+            attr.sched_deadline = attr.sched_period;
+            attr.sched_runtime = attr.sched_period / 2;
+
+            if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0)
+            {
+                fprintf(stderr, "Error setting deadline scheduler of %s thread: %i\n", thread_name, errno);
+            }
+            break;
+
+        default:
+            break;
     }
 }
 
@@ -123,1480 +488,4911 @@ static void subscription_event(snd_seq_event_t *event)
     }
 }
 
-static void write_event(const uint8_t *event, unsigned int length)
+static void event_ring_put(event_ring_t *ring, unsigned int index, const void *data, unsigned int length)
 {
-    int read_index, write_index;
-    unsigned int free_space;
+    unsigned int offset;
+
+    offset = index & (EVENT_BUFFER_SIZE - 1);
+    if (length <= EVENT_BUFFER_SIZE - offset)
+    {
+        memcpy(&(ring->buffer[offset]), data, length);
+    }
+    else
+    {
+        memcpy(&(ring->buffer[offset]), data, EVENT_BUFFER_SIZE - offset);
+        memcpy(&(ring->buffer[0]), (const uint8_t *)data + (EVENT_BUFFER_SIZE - offset), length - (EVENT_BUFFER_SIZE - offset));
+    }
+}
 
-    // read global volatile variables to local variables
-    read_index = event_read_index;
-    write_index = event_write_index;
+static void event_ring_get(const event_ring_t *ring, unsigned int index, void *data, unsigned int length)
+{
+    unsigned int offset;
 
-    if (write_index >= read_index)
+    offset = index & (EVENT_BUFFER_SIZE - 1);
+    if (length <= EVENT_BUFFER_SIZE - offset)
     {
-        free_space = 65535 - (write_index - read_index);
+        memcpy(data, &(ring->buffer[offset]), length);
     }
     else
     {
-        free_space = (read_index - write_index) - 1;
+        memcpy(data, &(ring->buffer[offset]), EVENT_BUFFER_SIZE - offset);
+        memcpy((uint8_t *)data + (EVENT_BUFFER_SIZE - offset), &(ring->buffer[0]), length - (EVENT_BUFFER_SIZE - offset));
     }
+}
 
-    if (length > free_space)
+// returns non-zero if there is free space for events of given length
+static int event_ring_has_space(event_ring_t *ring, unsigned int length)
+{
+    if (length > EVENT_BUFFER_SIZE - (ring->pending_index - ring->cached_read_index))
     {
-        fprintf(stderr, "Event buffer overflow\n");
-        return;
+        // refresh cached read index only when the ring looks full
+        ring->cached_read_index = atomic_load_explicit(&ring->read_index, memory_order_acquire);
+        if (length > EVENT_BUFFER_SIZE - (ring->pending_index - ring->cached_read_index))
+        {
+            return 0;
+        }
     }
 
-    // write event to event buffer
-    for (; length != 0; length--,event++)
+    return 1;
+}
+
+static int event_ring_write(event_ring_t *ring, const event_header_t *header, const uint8_t *data)
+{
+    if (!event_ring_has_space(ring, sizeof(event_header_t) + header->length))
     {
-        event_buffer[write_index] = *event;
-        write_index = (write_index + 1) & 0xffff;
+        return -1;
     }
 
-    // update global volatile variable
-    event_write_index = write_index;
+    event_ring_put(ring, ring->pending_index, header, sizeof(event_header_t));
+    event_ring_put(ring, ring->pending_index + sizeof(event_header_t), data, header->length);
+
+    ring->pending_index += sizeof(event_header_t) + header->length;
 
-    midi_event_written = 1;
+    return 0;
 }
 
-static void process_event(snd_seq_event_t *event, uint8_t *running_status)
+// make written events visible to consumer, returns non-zero if there were any new events
+static int event_ring_publish(event_ring_t *ring)
 {
-    uint8_t data[12];
-    int length;
-
-    switch (event->type)
+    if (ring->pending_index == atomic_load_explicit(&ring->write_index, memory_order_relaxed))
     {
-        case SND_SEQ_EVENT_NOTEON:
-            data[0] = 0x90 | event->data.note.channel;
-            data[1] = event->data.note.note;
-            data[2] = event->data.note.velocity;
-            length = 3;
+        return 0;
+    }
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
-            {
-                write_event(data + 1, length - 1);
-            }
+    atomic_store_explicit(&ring->write_index, ring->pending_index, memory_order_release);
 
-#ifdef PRINT_EVENTS
-            printf("Note ON, channel:%d note:%d velocity:%d\n", event->data.note.channel, event->data.note.note, event->data.note.velocity);
-#endif
+    return 1;
+}
 
-            break;
+static void publish_events(void)
+{
+    int index, published;
 
-        case SND_SEQ_EVENT_NOTEOFF:
-            // send note off event as note on with zero velocity to increase the chance of using running status
-            data[0] = 0x90 | event->data.note.channel;
-            data[1] = event->data.note.note;
-            data[2] = 0;
-            length = 3;
+    published = 0;
+    for (index = 0; index < num_inputs; index++)
+    {
+        published |= event_ring_publish(inputs[index].ring);
+    }
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
-            {
-                write_event(data + 1, length - 1);
-            }
+    if (!published)
+    {
+        return;
+    }
 
-#ifdef PRINT_EVENTS
-            printf("Note OFF, channel:%d note:%d velocity:%d\n", event->data.note.channel, event->data.note.note, event->data.note.velocity);
-#endif
+    // wake up render loop (only once until it notices the events)
+    if (atomic_exchange(&midi_event_written, 1) == 0)
+    {
+        eventfd_write(event_fd, 1);
+    }
+}
 
-            break;
+// returns non-zero if all spilled events were moved to the event ring
+static int flush_spilled_events(midi_input_t *input)
+{
+    spill_buffer_t *spill;
+    event_header_t header;
 
-        case SND_SEQ_EVENT_KEYPRESS:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xA0 | event->data.note.channel;
-            data[1] = event->data.note.note;
-            data[2] = event->data.note.velocity;
-            length = 3;
+    spill = &(input->spill);
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
-            {
-                write_event(data + 1, length - 1);
-            }
-#endif
+    while (spill->read_offset != spill->write_offset)
+    {
+        memcpy(&header, spill->buffer + spill->read_offset, sizeof(event_header_t));
+        if (event_ring_write(input->ring, &header, spill->buffer + spill->read_offset + sizeof(event_header_t)) < 0)
+        {
+            return 0;
+        }
 
-#ifdef PRINT_EVENTS
-            printf("Keypress, channel:%d note:%d velocity:%d\n", event->data.note.channel, event->data.note.note, event->data.note.velocity);
-#endif
+        spill->read_offset += sizeof(event_header_t) + header.length;
+    };
 
-            break;
+    spill->read_offset = 0;
+    spill->write_offset = 0;
 
-        case SND_SEQ_EVENT_CONTROLLER:
-            data[0] = 0xB0 | event->data.control.channel;
-            data[1] = event->data.control.param;
-            data[2] = event->data.control.value;
-            length = 3;
+    return 1;
+}
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
-            {
-                write_event(data + 1, length - 1);
-            }
+static int spill_event(spill_buffer_t *spill, const event_header_t *header, const uint8_t *data)
+{
+    unsigned int length;
 
-#ifdef PRINT_EVENTS
-            printf("Controller, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
-#endif
+    length = sizeof(event_header_t) + header->length;
 
-            break;
+    if (length > SPILL_BUFFER_SIZE - spill->write_offset)
+    {
+        // move remaining events to the beginning of spill buffer
+        if (spill->read_offset != 0)
+        {
+            memmove(spill->buffer, spill->buffer + spill->read_offset, spill->write_offset - spill->read_offset);
+            spill->write_offset -= spill->read_offset;
+            spill->read_offset = 0;
+        }
 
-        case SND_SEQ_EVENT_PGMCHANGE:
-            data[0] = 0xC0 | event->data.control.channel;
-            data[1] = event->data.control.value;
-            length = 2;
+        if (length > SPILL_BUFFER_SIZE - spill->write_offset)
+        {
+            return -1;
+        }
+    }
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
-            {
-                write_event(data + 1, length - 1);
-            }
+    memcpy(spill->buffer + spill->write_offset, header, sizeof(event_header_t));
+    memcpy(spill->buffer + spill->write_offset + sizeof(event_header_t), data, header->length);
+    spill->write_offset += length;
 
-#ifdef PRINT_EVENTS
-            printf("Program change, channel:%d value:%d\n", event->data.control.channel, event->data.control.value);
-#endif
+    stat_add(&stats.events_spilled, 1);
+    stat_max(&stats.spill_max_bytes, spill->write_offset - spill->read_offset);
 
-            break;
+    return 0;
+}
 
-        case SND_SEQ_EVENT_CHANPRESS:
-            data[0] = 0xD0 | event->data.control.channel;
-            data[1] = event->data.control.value;
-            length = 2;
+static int wait_for_event_space(event_ring_t *ring, unsigned int length)
+{
+    stat_add(&stats.producer_blocked, 1);
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
-            {
-                write_event(data + 1, length - 1);
-            }
+    // render loop can only free space, when the events are published
+    publish_events();
 
-#ifdef PRINT_EVENTS
-            printf("Channel pressure, channel:%d value:%d\n", event->data.control.channel, event->data.control.value);
-#endif
+    while (!event_ring_has_space(ring, length))
+    {
+        struct timespec req;
 
-            break;
+        if (midi_init_state < 0)
+        {
+            return -1;
+        }
 
-        case SND_SEQ_EVENT_PITCHBEND:
-            data[0] = 0xE0 | event->data.control.channel;
-            data[1] = (event->data.control.value + 0x2000) & 0x7f;
-            data[2] = ((event->data.control.value + 0x2000) >> 7) & 0x7f;
-            length = 3;
+        req.tv_sec = 0;
+        req.tv_nsec = 1000000;
+        nanosleep(&req, NULL);
+    };
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
+    return 0;
+}
+
+static int get_event_class(const uint8_t *event, unsigned int length)
+{
+    if (length < 3)
+    {
+        return EVENT_CLASS_NORMAL;
+    }
+
+    switch (event[0] & 0xF0)
+    {
+        case 0x80:
+            return EVENT_CLASS_RELEASE;
+        case 0x90:
+            return (event[2] == 0) ? EVENT_CLASS_RELEASE : EVENT_CLASS_NOTE_ON;
+        case 0xB0:
+            // channel mode messages (all sound off, all notes off, ...) or released pedal
+            if ((event[1] >= 120) || (event[1] >= 64 && event[1] <= 69 && event[2] < 64))
             {
-                write_event(data + 1, length - 1);
+                return EVENT_CLASS_RELEASE;
             }
+            return EVENT_CLASS_NORMAL;
+        default:
+            return EVENT_CLASS_NORMAL;
+    }
+}
 
-#ifdef PRINT_EVENTS
-            printf("Pitch bend, channel:%d value:%d\n", event->data.control.channel, event->data.control.value);
-#endif
+// store event in event ring or handle overflow according to overflow policy
+static int store_event(midi_input_t *input, const event_header_t *header, const uint8_t *data, int event_class)
+{
+    event_ring_t *ring;
+    unsigned int length;
 
-            break;
+    ring = input->ring;
 
-        case SND_SEQ_EVENT_CONTROL14:
-            if (event->data.control.param >= 0 && event->data.control.param < 32)
-            {
-                data[0] = 0xB0 | event->data.control.channel;
-                data[1] = event->data.control.param;
-                data[2] = (event->data.control.value >> 7) & 0x7f;
-                data[3] = event->data.control.param + 32;
-                data[4] = event->data.control.value & 0x7f;
-                length = 5;
+    length = sizeof(event_header_t) + header->length;
 
-                if (data[0] != *running_status)
-                {
-                    *running_status = data[0];
-                    write_event(data, length);
-                }
-                else
-                {
-                    write_event(data + 1, length - 1);
-                }
+    if (length > EVENT_BUFFER_SIZE)
+    {
+        stat_add(&stats.events_dropped, 1);
+        fprintf(stderr, "Event too large: %u\n", header->length);
+        return -1;
+    }
 
-#ifdef PRINT_EVENTS
-                printf("Controller 14-bit, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
-#endif
-            }
-            else
-            {
-#ifdef PRINT_EVENTS
-                printf("Unknown controller, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
-#endif
-            }
+    // keep order of events - while there are spilled events, new events must be spilled too
+    if (input->spill.read_offset != input->spill.write_offset && !flush_spilled_events(input))
+    {
+        if (spill_event(&(input->spill), header, data) == 0)
+        {
+            return 0;
+        }
 
+        stat_add(&stats.events_dropped, 1);
+        fprintf(stderr, "Event buffer overflow\n");
+        return -1;
+    }
 
-            break;
+    if (event_class == EVENT_CLASS_NOTE_ON && overflow_policy == OVERFLOW_DROP_NOTE_ON)
+    {
+        // keep space for events releasing notes
+        if (!event_ring_has_space(ring, length + EVENT_RESERVE_SIZE))
+        {
+            stat_add(&stats.note_ons_dropped, 1);
+            stat_add(&stats.events_dropped, 1);
+            return -1;
+        }
+    }
 
-        case SND_SEQ_EVENT_NONREGPARAM:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xB0 | event->data.control.channel;
-            data[1] = 0x63; // NRPN MSB
-            data[2] = (event->data.control.param >> 7) & 0x7f;
-            data[3] = 0x62; // NRPN LSB
-            data[4] = event->data.control.param & 0x7f;
-            data[5] = 0x06; // data entry MSB
-            data[6] = (event->data.control.value >> 7) & 0x7f;
-            data[7] = 0x26; // data entry LSB
-            data[8] = event->data.control.value & 0x7f;
-            length = 9;
+    if (event_ring_write(ring, header, data) == 0)
+    {
+        return 0;
+    }
 
-            if (data[0] != *running_status)
-            {
-                *running_status = data[0];
-                write_event(data, length);
-            }
-            else
+    switch (overflow_policy)
+    {
+        case OVERFLOW_SPILL:
+            if (spill_event(&(input->spill), header, data) == 0)
             {
-                write_event(data + 1, length - 1);
+                return 0;
             }
-#endif
-
-#ifdef PRINT_EVENTS
-            printf("NRPN, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
-#endif
-
             break;
 
-        case SND_SEQ_EVENT_REGPARAM:
-            data[0] = 0xB0 | event->data.control.channel;
-            data[1] = 0x65; // RPN MSB
-            data[2] = (event->data.control.param >> 7) & 0x7f;
-            data[3] = 0x64; // RPN LSB
-            data[4] = event->data.control.param & 0x7f;
-            data[5] = 0x06; // data entry MSB
-            data[6] = (event->data.control.value >> 7) & 0x7f;
-            data[7] = 0x26; // data entry LSB
-            data[8] = event->data.control.value & 0x7f;
-            length = 9;
-
-            if (data[0] != *running_status)
+        case OVERFLOW_DROP_NOTE_ON:
+            if (event_class != EVENT_CLASS_RELEASE)
             {
-                *running_status = data[0];
-                write_event(data, length);
+                break;
             }
-            else
+            // fallthrough - events releasing notes are never dropped
+        case OVERFLOW_BLOCK:
+            if (wait_for_event_space(ring, length) == 0)
             {
-                write_event(data + 1, length - 1);
+                return event_ring_write(ring, header, data);
             }
-
-#ifdef PRINT_EVENTS
-            printf("RPN, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
-#endif
-
             break;
 
-        case SND_SEQ_EVENT_SYSEX:
-            length = event->data.ext.len;
+        default:
+            break;
+    }
 
-            *running_status = 0;
-            write_event(event->data.ext.ptr, length);
+    stat_add(&stats.events_dropped, 1);
+    fprintf(stderr, "Event buffer overflow\n");
+    return -1;
+}
 
-#ifdef PRINT_EVENTS
-            printf("SysEx (fragment) of size %d\n", event->data.ext.len);
-#endif
+static void write_event(midi_input_t *input, const uint8_t *event, unsigned int length)
+{
+    event_header_t header;
+    const uint8_t *data;
+    int is_channel_message;
 
-            break;
+    if (length == 0)
+    {
+        return;
+    }
 
-        case SND_SEQ_EVENT_QFRAME:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xF1;
-            data[1] = ev->data.control.value;
-            length = 2;
+    is_channel_message = (event[0] >= 0x80 && event[0] < 0xF0);
 
-            *running_status = 0;
-            write_event(data, length);
-#endif
+    // leave out status byte when running status can be used
+    data = event;
+    if (is_channel_message && event[0] == input->ring->write_status)
+    {
+        data++;
+    }
 
-#ifdef PRINT_EVENTS
-            printf("MTC Quarter Frame, value:%d\n", event->data.control.value);
-#endif
+    memset(&header, 0, sizeof(event_header_t));
+    header.time = event_timing ? get_time_ns() : 0;
+    header.length = length - (data - event);
 
-            break;
+    if (store_event(input, &header, data, get_event_class(event, length)) < 0)
+    {
+        // running status is not changed by dropped event
+        return;
+    }
 
-        case SND_SEQ_EVENT_SONGPOS:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xF2;
-            data[1] = (event->data.control.value + 0x2000) & 0x7f;
-            data[2] = ((event->data.control.value + 0x2000) >> 7) & 0x7f;
-            length = 3;
+    input->ring->write_status = is_channel_message ? event[0] : 0;
+}
 
-            *running_status = 0;
-            write_event(data, length);
-#endif
+// returns synth instance used by the client, a free instance from the pool is assigned to new client
+static midi_input_t *attach_client(int client)
+{
+    midi_input_t *input;
+    int index;
 
-#ifdef PRINT_EVENTS
-            printf("Song Position, value:%d\n", event->data.control.value);
-#endif
+    if (client_input[client & 0xFF] >= 0)
+    {
+        return &(inputs[(int)client_input[client & 0xFF]]);
+    }
 
-            break;
+    pthread_mutex_lock(&pool_mutex);
+    index = (num_free_inputs > 0) ? free_inputs[--num_free_inputs] : -1;
+    pthread_mutex_unlock(&pool_mutex);
 
-        case SND_SEQ_EVENT_SONGSEL:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xF3;
-            data[1] = ev->data.control.value;
-            length = 2;
+    // let the pool thread prepare another instance
+    sem_post(&pool_sem);
 
-            *running_status = 0;
-            write_event(data, length);
-#endif
+    if (index < 0)
+    {
+        return NULL;
+    }
 
-#ifdef PRINT_EVENTS
-            printf("Song Select, value:%d\n", event->data.control.value);
-#endif
+    input = &(inputs[index]);
+    input->client = client;
+    input->subscriptions = 0;
+    client_input[client & 0xFF] = index;
+    refused_clients[client & 0xFF] = 0;
+    atomic_store_explicit(&(input->state), INPUT_ACTIVE, memory_order_release);
 
-            break;
+    printf("Client %i uses synth instance %i\n", client, index);
 
-        case SND_SEQ_EVENT_TUNE_REQUEST:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xF6;
-            length = 1;
+    return input;
+}
 
-            *running_status = 0;
-            write_event(data, length);
-#endif
+// stop rendering the synth instance, it's returned to the pool after reset by pool thread
+static void detach_client(midi_input_t *input)
+{
+    client_input[input->client & 0xFF] = -1;
+    input->client = -1;
 
-#ifdef PRINT_EVENTS
-            printf("Tune Request\n");
-#endif
+    // events of the client must be visible to render thread before it discards them
+    event_ring_publish(input->ring);
+    input->ring->write_status = 0;
 
-            break;
+    // spilled events of the client must not be played by the next client
+    input->spill.read_offset = 0;
+    input->spill.write_offset = 0;
 
-        case SND_SEQ_EVENT_CLOCK:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xF8;
-            length = 1;
+    atomic_store_explicit(&(input->state), INPUT_RELEASED, memory_order_release);
+}
 
-            write_event(data, length);
-#endif
+// remember held notes and pressed sustain pedals of the sender
+static void track_sender_notes(const midi_input_t *input, const snd_seq_event_t *event)
+{
+    sender_notes_t *sender;
+    unsigned int port, channel, note;
+    uint64_t mask;
+    int pressed;
 
-#ifdef PRINT_EVENTS
-            printf("Clock\n");
-#endif
+    sender = sender_notes[event->source.client & 0xFF];
+    if (sender == NULL)
+    {
+        // state is allocated when the sender presses a key or a sustain pedal
+        if (!(event->type == SND_SEQ_EVENT_NOTEON && event->data.note.velocity != 0) &&
+            !(event->type == SND_SEQ_EVENT_CONTROLLER && event->data.control.param == 64 && event->data.control.value >= 64)
+           )
+        {
+            return;
+        }
 
-            break;
+        sender = (sender_notes_t *) calloc(1, sizeof(sender_notes_t));
+        if (sender == NULL)
+        {
+            return;
+        }
+        sender_notes[event->source.client & 0xFF] = sender;
+    }
 
-        case SND_SEQ_EVENT_TICK:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xF9;
-            length = 1;
+    if (note_timeout > 0)
+    {
+        sender->last_event_time = get_time_ns();
+    }
 
-            write_event(data, length);
-#endif
+    port = input - inputs;
 
-#ifdef PRINT_EVENTS
-            printf("Tick\n");
-#endif
+    switch (event->type)
+    {
+        case SND_SEQ_EVENT_NOTEON:
+        case SND_SEQ_EVENT_NOTEOFF:
+            channel = event->data.note.channel & 0x0F;
+            note = event->data.note.note & 0x7F;
+            mask = (uint64_t)1 << (note & 63);
+            pressed = (event->type == SND_SEQ_EVENT_NOTEON && event->data.note.velocity != 0);
 
+            if (pressed && !(sender->notes[port][channel][note >> 6] & mask))
+            {
+                sender->notes[port][channel][note >> 6] |= mask;
+                sender->num_held++;
+            }
+            else if (!pressed && (sender->notes[port][channel][note >> 6] & mask))
+            {
+                sender->notes[port][channel][note >> 6] &= ~mask;
+                sender->num_held--;
+            }
             break;
 
-        case SND_SEQ_EVENT_START:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xFA;
-            length = 1;
-
-            write_event(data, length);
-#endif
+        case SND_SEQ_EVENT_CONTROLLER:
+            channel = event->data.control.channel & 0x0F;
 
-#ifdef PRINT_EVENTS
-            printf("Start\n");
-#endif
+            if (event->data.control.param == 64)
+            {
+                pressed = (event->data.control.value >= 64);
+                if (pressed && !(sender->sustain[port] & (1 << channel)))
+                {
+                    sender->sustain[port] |= 1 << channel;
+                    sender->num_held++;
+                }
+                else if (!pressed && (sender->sustain[port] & (1 << channel)))
+                {
+                    sender->sustain[port] &= ~(1 << channel);
+                    sender->num_held--;
+                }
+            }
+            else if (event->data.control.param == 120 || event->data.control.param == 123)
+            {
+                // all sound off / all notes off
+                for (note = 0; note < 128; note++)
+                {
+                    if (sender->notes[port][channel][note >> 6] & ((uint64_t)1 << (note & 63)))
+                    {
+                        sender->num_held--;
+                    }
+                }
+                sender->notes[port][channel][0] = 0;
+                sender->notes[port][channel][1] = 0;
+            }
+            else if (event->data.control.param == 121 && (sender->sustain[port] & (1 << channel)))
+            {
+                // reset all controllers releases sustain pedal
+                sender->sustain[port] &= ~(1 << channel);
+                sender->num_held--;
+            }
+            break;
 
+        default:
             break;
+    }
+}
 
-        case SND_SEQ_EVENT_CONTINUE:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xFB;
-            length = 1;
+// send note off events for held notes and release sustain pedals of the sender (on one port or on all ports if port is negative)
+static void release_sender_notes(int client, int port)
+{
+    sender_notes_t *sender;
+    int last_port;
+    unsigned int channel, note, num_released;
+    uint8_t data[3];
 
-            write_event(data, length);
-#endif
+    sender = sender_notes[client & 0xFF];
+    if (sender == NULL || sender->num_held == 0)
+    {
+        return;
+    }
 
-#ifdef PRINT_EVENTS
-            printf("Continue\n");
-#endif
+    if (port < 0)
+    {
+        port = 0;
+        last_port = num_inputs - 1;
+    }
+    else
+    {
+        last_port = port;
+    }
 
-            break;
+    num_released = 0;
+    for (; port <= last_port; port++)
+    {
+        for (channel = 0; channel < 16; channel++)
+        {
+            for (note = 0; note < 128; note++)
+            {
+                if (sender->notes[port][channel][note >> 6] & ((uint64_t)1 << (note & 63)))
+                {
+                    data[0] = 0x90 | channel;
+                    data[1] = note;
+                    data[2] = 0;
+                    write_event(&(inputs[port]), data, 3);
+                    num_released++;
+                }
+            }
 
-        case SND_SEQ_EVENT_STOP:
-            // Not used by Sonivox EAS
-#if 0
-            data[0] = 0xFC;
-            length = 1;
+            if (sender->sustain[port] & (1 << channel))
+            {
+                data[0] = 0xB0 | channel;
+                data[1] = 64;
+                data[2] = 0;
+                write_event(&(inputs[port]), data, 3);
+                num_released++;
+            }
+        }
 
-            write_event(data, length);
-#endif
+        memset(sender->notes[port], 0, sizeof(sender->notes[port]));
+        sender->sustain[port] = 0;
+    }
 
-#ifdef PRINT_EVENTS
-            printf("Stop\n");
+    if (num_released != 0)
+    {
+        printf("Released %u held notes and pedals of client %i\n", num_released, client);
+    }
+
+    sender->num_held -= num_released;
+}
+
+// release notes of senders which didn't send any events for too long
+static void release_idle_senders(void)
+{
+    uint64_t current_time;
+    int client;
+
+    current_time = get_time_ns();
+    if (current_time - last_timeout_check < 1000000000)
+    {
+        return;
+    }
+    last_timeout_check = current_time;
+
+    for (client = 0; client < 256; client++)
+    {
+        if (sender_notes[client] != NULL && sender_notes[client]->num_held != 0 &&
+            current_time - sender_notes[client]->last_event_time >= note_timeout * (uint64_t)1000000000
+           )
+        {
+            release_sender_notes(client, -1);
+        }
+    }
+}
+
+static int has_held_notes(void)
+{
+    int client;
+
+    for (client = 0; client < 256; client++)
+    {
+        if (sender_notes[client] != NULL && sender_notes[client]->num_held != 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// returns input which receives the event, or NULL
+// returns index of input which receives events from the sequencer port
+static int get_port_input(int port)
+{
+    int index;
+
+    for (index = 1; index < num_inputs; index++)
+    {
+        if (inputs[index].port_id == port)
+        {
+            return index;
+        }
+    }
+
+    return 0;
+}
+
+static midi_input_t *get_event_input(const snd_seq_event_t *event)
+{
+    int index;
+
+    if (isolate_clients && event->type != SND_SEQ_EVENT_PORT_SUBSCRIBED && event->type != SND_SEQ_EVENT_PORT_UNSUBSCRIBED)
+    {
+        // events from each client are rendered by own synth instance, which is attached on subscription
+        // (client sending events without subscription would never be detached)
+        index = client_input[event->source.client & 0xFF];
+        if (index < 0)
+        {
+            stat_add(&stats.events_dropped, 1);
+            if (!refused_clients[event->source.client & 0xFF])
+            {
+                refused_clients[event->source.client & 0xFF] = 1;
+                fprintf(stderr, "Dropping events of client %i without subscription or free synth instance\n", event->source.client);
+            }
+            return NULL;
+        }
+
+        return &(inputs[index]);
+    }
+
+    return &(inputs[get_port_input(event->dest.port)]);
+}
+
+static void process_event(snd_seq_event_t *event)
+{
+    midi_input_t *input;
+    uint8_t data[12];
+    int length;
+
+    input = get_event_input(event);
+    if (input == NULL)
+    {
+        return;
+    }
+
+    track_sender_notes(input, event);
+
+    switch (event->type)
+    {
+        case SND_SEQ_EVENT_NOTEON:
+            data[0] = 0x90 | event->data.note.channel;
+            data[1] = event->data.note.note;
+            data[2] = event->data.note.velocity;
+            length = 3;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("Note ON, channel:%d note:%d velocity:%d\n", event->data.note.channel, event->data.note.note, event->data.note.velocity);
 #endif
 
             break;
 
-        case SND_SEQ_EVENT_SENSING:
+        case SND_SEQ_EVENT_NOTEOFF:
+            // send note off event as note on with zero velocity to increase the chance of using running status
+            data[0] = 0x90 | event->data.note.channel;
+            data[1] = event->data.note.note;
+            data[2] = 0;
+            length = 3;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("Note OFF, channel:%d note:%d velocity:%d\n", event->data.note.channel, event->data.note.note, event->data.note.velocity);
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_KEYPRESS:
             // Not used by Sonivox EAS
 #if 0
-            data[0] = 0xFE;
-            length = 1;
+            data[0] = 0xA0 | event->data.note.channel;
+            data[1] = event->data.note.note;
+            data[2] = event->data.note.velocity;
+            length = 3;
 
-            write_event(data, length);
+            write_event(input, data, length);
 #endif
 
 #ifdef PRINT_EVENTS
-            printf("Active Sense\n");
+            printf("Keypress, channel:%d note:%d velocity:%d\n", event->data.note.channel, event->data.note.note, event->data.note.velocity);
 #endif
 
             break;
 
-        case SND_SEQ_EVENT_RESET:
+        case SND_SEQ_EVENT_CONTROLLER:
+            data[0] = 0xB0 | event->data.control.channel;
+            data[1] = event->data.control.param;
+            data[2] = event->data.control.value;
+            length = 3;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("Controller, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_PGMCHANGE:
+            data[0] = 0xC0 | event->data.control.channel;
+            data[1] = event->data.control.value;
+            length = 2;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("Program change, channel:%d value:%d\n", event->data.control.channel, event->data.control.value);
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_CHANPRESS:
+            data[0] = 0xD0 | event->data.control.channel;
+            data[1] = event->data.control.value;
+            length = 2;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("Channel pressure, channel:%d value:%d\n", event->data.control.channel, event->data.control.value);
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_PITCHBEND:
+            data[0] = 0xE0 | event->data.control.channel;
+            data[1] = (event->data.control.value + 0x2000) & 0x7f;
+            data[2] = ((event->data.control.value + 0x2000) >> 7) & 0x7f;
+            length = 3;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("Pitch bend, channel:%d value:%d\n", event->data.control.channel, event->data.control.value);
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_CONTROL14:
+            if (event->data.control.param >= 0 && event->data.control.param < 32)
+            {
+                data[0] = 0xB0 | event->data.control.channel;
+                data[1] = event->data.control.param;
+                data[2] = (event->data.control.value >> 7) & 0x7f;
+                data[3] = event->data.control.param + 32;
+                data[4] = event->data.control.value & 0x7f;
+                length = 5;
+
+                write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+                printf("Controller 14-bit, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
+#endif
+            }
+            else
+            {
+#ifdef PRINT_EVENTS
+                printf("Unknown controller, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
+#endif
+            }
+
+
+            break;
+
+        case SND_SEQ_EVENT_NONREGPARAM:
             // Not used by Sonivox EAS
 #if 0
-            data[0] = 0xFF;
-            length = 1;
+            data[0] = 0xB0 | event->data.control.channel;
+            data[1] = 0x63; // NRPN MSB
+            data[2] = (event->data.control.param >> 7) & 0x7f;
+            data[3] = 0x62; // NRPN LSB
+            data[4] = event->data.control.param & 0x7f;
+            data[5] = 0x06; // data entry MSB
+            data[6] = (event->data.control.value >> 7) & 0x7f;
+            data[7] = 0x26; // data entry LSB
+            data[8] = event->data.control.value & 0x7f;
+            length = 9;
 
-            write_event(data, length);
+            write_event(input, data, length);
 #endif
 
 #ifdef PRINT_EVENTS
-            printf("Reset\n");
+            printf("NRPN, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
 #endif
 
             break;
 
-        case SND_SEQ_EVENT_PORT_SUBSCRIBED:
-            subscription_event(event);
-            break;
+        case SND_SEQ_EVENT_REGPARAM:
+            data[0] = 0xB0 | event->data.control.channel;
+            data[1] = 0x65; // RPN MSB
+            data[2] = (event->data.control.param >> 7) & 0x7f;
+            data[3] = 0x64; // RPN LSB
+            data[4] = event->data.control.param & 0x7f;
+            data[5] = 0x06; // data entry MSB
+            data[6] = (event->data.control.value >> 7) & 0x7f;
+            data[7] = 0x26; // data entry LSB
+            data[8] = event->data.control.value & 0x7f;
+            length = 9;
+
+            write_event(input, data, length);
+
+#ifdef PRINT_EVENTS
+            printf("RPN, channel:%d param:%d value:%d\n", event->data.control.channel, event->data.control.param, event->data.control.value);
+#endif
 
-        case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
-            subscription_event(event);
             break;
 
-        default:
-            fprintf(stderr, "Unhandled event type: %i\n", event->type);
+        case SND_SEQ_EVENT_SYSEX:
+            length = event->data.ext.len;
+
+            write_event(input, event->data.ext.ptr, length);
+
+#ifdef PRINT_EVENTS
+            printf("SysEx (fragment) of size %d\n", event->data.ext.len);
+#endif
+
             break;
-    }
-}
 
-static void *midi_thread_proc(void *arg)
-{
-    snd_seq_event_t *event;
-    uint8_t running_status;
+        case SND_SEQ_EVENT_QFRAME:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xF1;
+            data[1] = ev->data.control.value;
+            length = 2;
 
-    // try setting thread scheduler (only root)
-    set_thread_scheduler();
+            write_event(input, data, length);
+#endif
 
-    // set thread as initialized
-    *(int *)arg = 1;
+#ifdef PRINT_EVENTS
+            printf("MTC Quarter Frame, value:%d\n", event->data.control.value);
+#endif
 
-    wait_for_midi_initialization();
+            break;
+
+        case SND_SEQ_EVENT_SONGPOS:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xF2;
+            data[1] = (event->data.control.value + 0x2000) & 0x7f;
+            data[2] = ((event->data.control.value + 0x2000) >> 7) & 0x7f;
+            length = 3;
 
-    running_status = 0;
+            write_event(input, data, length);
+#endif
 
-    while (midi_init_state > 0)
-    {
-        if (snd_seq_event_input(midi_seq, &event) < 0)
-        {
-            continue;
-        }
+#ifdef PRINT_EVENTS
+            printf("Song Position, value:%d\n", event->data.control.value);
+#endif
 
-        process_event(event, &running_status);
-    }
+            break;
 
-    return NULL;
+        case SND_SEQ_EVENT_SONGSEL:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xF3;
+            data[1] = ev->data.control.value;
+            length = 2;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Song Select, value:%d\n", event->data.control.value);
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_TUNE_REQUEST:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xF6;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Tune Request\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_CLOCK:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xF8;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Clock\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_TICK:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xF9;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Tick\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_START:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xFA;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Start\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_CONTINUE:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xFB;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Continue\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_STOP:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xFC;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Stop\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_SENSING:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xFE;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Active Sense\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_RESET:
+            // Not used by Sonivox EAS
+#if 0
+            data[0] = 0xFF;
+            length = 1;
+
+            write_event(input, data, length);
+#endif
+
+#ifdef PRINT_EVENTS
+            printf("Reset\n");
+#endif
+
+            break;
+
+        case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+            subscription_event(event);
+
+            if (isolate_clients)
+            {
+                input = attach_client(event->data.connect.sender.client);
+                if (input != NULL)
+                {
+                    input->subscriptions++;
+                }
+                else
+                {
+                    fprintf(stderr, "No free synth instance for client %i\n", event->data.connect.sender.client);
+                }
+            }
+            break;
+
+        case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+            subscription_event(event);
+
+            // free voices used by notes which would be otherwise stuck (the client can still be subscribed to other ports)
+            release_sender_notes(event->data.connect.sender.client, isolate_clients ? -1 : get_port_input(event->data.connect.dest.port));
+
+            if (isolate_clients)
+            {
+                input = (client_input[event->data.connect.sender.client & 0xFF] >= 0) ? &(inputs[(int)client_input[event->data.connect.sender.client & 0xFF]]) : NULL;
+                if (input != NULL)
+                {
+                    input->subscriptions--;
+                    if (input->subscriptions <= 0)
+                    {
+                        detach_client(input);
+                    }
+                }
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Unhandled event type: %i\n", event->type);
+            break;
+    }
+}
+
+static void *midi_thread_proc(void *arg)
+{
+    snd_seq_event_t *event;
+    struct pollfd *seq_fds;
+    int num_seq_fds;
+
+    // try setting thread scheduler (only root)
+    set_thread_scheduler(&midi_sched, "midi");
+
+    // set thread as initialized
+    ((thread_start_t *)arg)->initialized = 1;
+
+    wait_for_midi_initialization();
+
+    num_seq_fds = (midi_init_state > 0) ? snd_seq_poll_descriptors_count(midi_seq, POLLIN) : 0;
+    if (num_seq_fds < 0)
+    {
+        num_seq_fds = 0;
+    }
+    seq_fds = (struct pollfd *) alloca((num_seq_fds + 1) * sizeof(struct pollfd));
+    if (num_seq_fds > 0)
+    {
+        num_seq_fds = snd_seq_poll_descriptors(midi_seq, seq_fds, num_seq_fds, POLLIN);
+    }
+
+    while (midi_init_state > 0)
+    {
+        int index, spilled;
+
+        spilled = 0;
+        for (index = 0; index < num_inputs; index++)
+        {
+            if (inputs[index].spill.read_offset != inputs[index].spill.write_offset)
+            {
+                spilled = 1;
+            }
+        }
+
+        if (spilled && (snd_seq_event_input_pending(midi_seq, 0) <= 0))
+        {
+            // while waiting for new events, retry moving spilled events into the event rings
+            if (poll(seq_fds, num_seq_fds, 1) <= 0)
+            {
+                for (index = 0; index < num_inputs; index++)
+                {
+                    flush_spilled_events(&(inputs[index]));
+                }
+                publish_events();
+                continue;
+            }
+        }
+        else if (note_timeout > 0 && has_held_notes() && (snd_seq_event_input_pending(midi_seq, 0) <= 0))
+        {
+            // wake up periodically to release notes of idle senders
+            if (poll(seq_fds, num_seq_fds, 1000) <= 0)
+            {
+                release_idle_senders();
+                publish_events();
+                continue;
+            }
+        }
+
+        if (snd_seq_event_input(midi_seq, &event) < 0)
+        {
+            continue;
+        }
+
+        // process all events which were already read from the sequencer and publish them together
+        while (1)
+        {
+            process_event(event);
+
+            if (snd_seq_event_input_pending(midi_seq, 0) <= 0)
+            {
+                break;
+            }
+
+            if (snd_seq_event_input(midi_seq, &event) < 0)
+            {
+                break;
+            }
+        };
+
+        if (note_timeout > 0)
+        {
+            release_idle_senders();
+        }
+
+        publish_events();
+    }
+
+    return NULL;
+}
+
+static void usage(const char *progname)
+{
+    static const char basename[] = "eas_alsadrv";
+
+    if (progname == NULL)
+    {
+        progname = basename;
+    }
+    else
+    {
+        const char *slash;
+
+        slash = strrchr(progname, '/');
+        if (slash != NULL)
+        {
+            progname = slash + 1;
+        }
+    }
+
+    printf(
+        "%s - Sonivox EAS\n"
+        "Usage: %s [OPTIONS]...\n"
+        "  -p NUM   Polyphony\n"
+        "  -m NUM   Master volume (0-100)\n"
+        "  -s PATH  Dls soundfont path (path to .dls file)\n"
+        "  -r NUM   Reverb preset (0=off, 1=large hall, 2=hall, 3=chamber, 4=room)\n"
+        "  -w NUM   Reverb wet (0-32767)\n"
+        "  -c NUM   Chorus preset (0=off, 1=preset 1, 2=preset 2, 3=preset 3, 4=preset 4)\n"
+        "  -a NUM   Chorus rate (10-50)\n"
+        "  -e NUM   Chorus depth (15-60)\n"
+        "  -l NUM   Chorus level (0-32767)\n"
+        "  -P NUM   Number of sequencer ports, each with own 16 midi channels (1-16)\n"
+        "  -D NAME  PCM device (can be repeated, devices are tried in the given order; default: default)\n"
+        "  -d       Daemonize\n"
+        "  --seq-device NAME  ALSA sequencer device (default: default)\n"
+        "  --event-timing  Play events with constant latency (timestamped on arrival)\n"
+        "  --coalesce      Coalesce controller and pitch bend changes within render block\n"
+        "  --overflow POLICY  Event buffer overflow policy (drop, block, spill, drop-noteon)\n"
+        "  --render-sched POLICY  Scheduling policy of render thread (other, fifo, rr, deadline)\n"
+        "  --render-priority NUM  Scheduling priority of render thread\n"
+        "  --render-cpus LIST     CPUs for render thread (e.g. 2,4-5)\n"
+        "  --midi-sched POLICY    Scheduling policy of midi thread (other, fifo, rr, deadline)\n"
+        "  --midi-priority NUM    Scheduling priority of midi thread\n"
+        "  --midi-cpus LIST       CPUs for midi thread\n"
+        "  --latency MS    Size of pcm buffer in milliseconds\n"
+        "  --probe-latency FILE  Find the smallest pcm buffer without underruns and write it to FILE\n"
+        "  --latency-file FILE   Load pcm buffer size written by --probe-latency (unless --latency or --periods is used)\n"
+        "  --periods NUM   Size of pcm buffer in periods (EAS mix buffers)\n"
+        "  --margin MS     Amount of audio kept in pcm buffer (default: buffer size - 2 periods)\n"
+        "  --adaptive      Adapt render margin to buffer underruns\n"
+        "  --adaptive-decay SEC  Lower adaptive render margin after SEC seconds without underruns (default: 30)\n"
+        "  --mmap          Render directly into pcm buffer using mmap access\n"
+        "  --format FORMAT  Preferred PCM sample format (s16, s24, s32, float), default: first format supported by the device\n"
+        "  --dither  Use TPDF dither when converting resampled audio to 16 bits\n"
+        "  --src-quality NUM  Quality of internal resampler used when pcm rate differs from EAS rate (0 = off, 1 - 3, default: 2)\n"
+        "  --engines NUM   Number of EAS engines rendered in parallel by worker threads (1-16, per port with --port-engines)\n"
+        "  --distribute MODE  Distribute events between engines by midi channel or by voice (channels, voices)\n"
+        "  --channel-map LIST  Engine rendering each midi channel (e.g. 0,0,1,1,...; default: channel modulo engines)\n"
+        "  --port-engines  Use separate engines for each port (default: ports share engines using separate midi streams)\n"
+        "  --isolate NUM   Render each client by own synth instance, at most NUM instances (1-16)\n"
+        "  --pool NUM      Number of initialized synth instances kept ready for new clients (default: all)\n"
+        "  --batch  Render all blocks which fit into PCM buffer and write them at once\n"
+        "  --render-ahead N  Render up to N blocks ahead in a separate thread\n"
+        "  --close-idle SEC  Close PCM device after SEC seconds without events and reopen it on the next event\n"
+        "  --note-timeout SEC  Release notes held by a client which didn't send any events for SEC seconds\n"
+        "  --skip-silence PEAK  Stop rendering engines without held notes after their output stays below PEAK (0-32767)\n"
+        "  --worker-cpus LIST  CPUs for worker threads (each worker is pinned to one CPU)\n"
+        "  -h       Help\n"
+        "Statistics are printed after receiving SIGUSR1\n",
+        basename,
+        progname
+    );
+    exit(1);
+}
+
+static int parse_sched_policy(const char *name)
+{
+    if (strcmp(name, "other") == 0) return SCHED_OTHER;
+    if (strcmp(name, "fifo") == 0) return SCHED_FIFO;
+    if (strcmp(name, "rr") == 0) return SCHED_RR;
+    if (strcmp(name, "deadline") == 0) return SCHED_DEADLINE;
+    return -1;
+}
+
+static int parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+    char *end;
+    long first, last;
+
+    CPU_ZERO(cpus);
+
+    while (*list != 0)
+    {
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0 || first >= CPU_SETSIZE) return -1;
+
+        last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first || last >= CPU_SETSIZE) return -2;
+        }
+
+        for (; first <= last; first++)
+        {
+            CPU_SET(first, cpus);
+        }
+
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != 0)
+        {
+            return -3;
+        }
+
+        list = end;
+    };
+
+    return 0;
+}
+
+static void read_arguments(int argc, char *argv[]) __attribute__((noinline));
+static void read_arguments(int argc, char *argv[])
+{
+    int i, j;
+
+    polyphony = 0;
+    master_volume = -1;
+    daemonize = 0;
+    event_timing = 0;
+    coalesce_events = 0;
+    overflow_policy = OVERFLOW_DROP;
+    memset(&midi_sched, 0, sizeof(thread_sched_t));
+    midi_sched.policy = SCHED_FIFO;
+    midi_sched.priority = -1;
+    memset(&render_sched, 0, sizeof(thread_sched_t));
+    render_sched.policy = SCHED_FIFO;
+    render_sched.priority = sched_get_priority_min(SCHED_FIFO) + 1;
+    latency_ms = -1;
+    latency_periods = -1;
+    margin_ms = -1;
+    adaptive_margin = 0;
+    adaptive_decay = 30;
+    use_mmap = 0;
+    src_quality = -1;
+    num_engines = 0;
+    distribute_voices = 0;
+    num_inputs = 1;
+    separate_port_engines = 0;
+    isolate_clients = 0;
+    pool_size = 0;
+    note_timeout = 0;
+    close_timeout = 0;
+    render_ahead = 0;
+    batch_blocks = 0;
+    preferred_format = SND_PCM_FORMAT_UNKNOWN;
+    use_dither = 0;
+    num_pcm_devices = 0;
+    seq_device = "default";
+    probe_filepath = NULL;
+    latency_filepath = NULL;
+    skip_silence = -1;
+    for (i = 0; i < 16; i++)
+    {
+        channel_map[i] = -1;
+    }
+    use_worker_cpus = 0;
+    reverb_preset = 0;
+    reverb_wet = -1;
+    chorus_preset = 0;
+    chorus_rate = -1;
+    chorus_depth = -1;
+    chorus_level = -1;
+    dls_filepath = NULL;
+
+    if (argc <= 1)
+    {
+        return;
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (argv[i][0] == '-' && argv[i][1] != 0 && argv[i][2] == 0)
+        {
+            switch (argv[i][1])
+            {
+                case 'p': // polyphony
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 0)
+                        {
+                            polyphony = j;
+                        }
+                    }
+                    break;
+                case 'm': // master volume
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 0 && j <= 100)
+                        {
+                            master_volume = j;
+                        }
+                    }
+                    break;
+                case 's': // dls soundfont path
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        dls_filepath = argv[i];
+                    }
+                    break;
+                case 'r': // reverb preset
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 0 && j <= 4)
+                        {
+                            reverb_preset = j;
+                        }
+                    }
+                    break;
+                case 'w': // reverb wet
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 0 && j <= 32767)
+                        {
+                            reverb_wet = j;
+                        }
+                    }
+                    break;
+                case 'c': // chorus preset
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 0 && j <= 4)
+                        {
+                            chorus_preset = j;
+                        }
+                    }
+                    break;
+                case 'a': // chorus rate
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 10 && j <= 50)
+                        {
+                            chorus_rate = j;
+                        }
+                    }
+                    break;
+                case 'e': // chorus depth
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 15 && j <= 60)
+                        {
+                            chorus_depth = j;
+                        }
+                    }
+                    break;
+                case 'l': // chorus level
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 0 && j <= 32767)
+                        {
+                            chorus_level = j;
+                        }
+                    }
+                    break;
+                case 'P': // number of ports
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        j = atoi(argv[i]);
+                        if (j >= 1 && j <= MAX_PORTS)
+                        {
+                            num_inputs = j;
+                        }
+                    }
+                    break;
+                case 'D': // pcm device
+                    if ((i + 1) < argc)
+                    {
+                        i++;
+                        if (num_pcm_devices < MAX_PCM_DEVICES)
+                        {
+                            pcm_devices[num_pcm_devices] = argv[i];
+                            num_pcm_devices++;
+                        }
+                    }
+                    break;
+                case 'd': // daemonize
+                    daemonize = 1;
+                    break;
+                case 'h': // help
+                    usage(argv[0]);
+                default:
+                    break;
+            }
+        }
+        else if (strcmp(argv[i], "--seq-device") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                seq_device = argv[i];
+            }
+        }
+        else if (strcmp(argv[i], "--probe-latency") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                probe_filepath = argv[i];
+            }
+        }
+        else if (strcmp(argv[i], "--latency-file") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                latency_filepath = argv[i];
+            }
+        }
+        else if (strcmp(argv[i], "--event-timing") == 0)
+        {
+            event_timing = 1;
+        }
+        else if (strcmp(argv[i], "--coalesce") == 0)
+        {
+            coalesce_events = 1;
+        }
+        else if (strcmp(argv[i], "--overflow") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                if (strcmp(argv[i], "drop") == 0)
+                {
+                    overflow_policy = OVERFLOW_DROP;
+                }
+                else if (strcmp(argv[i], "block") == 0)
+                {
+                    overflow_policy = OVERFLOW_BLOCK;
+                }
+                else if (strcmp(argv[i], "spill") == 0)
+                {
+                    overflow_policy = OVERFLOW_SPILL;
+                }
+                else if (strcmp(argv[i], "drop-noteon") == 0)
+                {
+                    overflow_policy = OVERFLOW_DROP_NOTE_ON;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--render-sched") == 0 || strcmp(argv[i], "--midi-sched") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = parse_sched_policy(argv[i]);
+                if (j >= 0)
+                {
+                    ((strncmp(argv[i - 1], "--render", 8) == 0) ? &render_sched : &midi_sched)->policy = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--render-priority") == 0 || strcmp(argv[i], "--midi-priority") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 0 && j <= 99)
+                {
+                    ((strncmp(argv[i - 1], "--render", 8) == 0) ? &render_sched : &midi_sched)->priority = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--render-cpus") == 0 || strcmp(argv[i], "--midi-cpus") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                thread_sched_t *sched;
+
+                i++;
+                sched = (strncmp(argv[i - 1], "--render", 8) == 0) ? &render_sched : &midi_sched;
+                if (parse_cpu_list(argv[i], &(sched->affinity)) == 0)
+                {
+                    sched->use_affinity = 1;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--latency") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j > 0)
+                {
+                    latency_ms = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--periods") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 3)
+                {
+                    latency_periods = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--margin") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j > 0)
+                {
+                    margin_ms = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--adaptive") == 0)
+        {
+            adaptive_margin = 1;
+        }
+        else if (strcmp(argv[i], "--adaptive-decay") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j > 0)
+                {
+                    adaptive_decay = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            use_mmap = 1;
+        }
+        else if (strcmp(argv[i], "--format") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                if (strcmp(argv[i], "s16") == 0)
+                {
+                    preferred_format = SND_PCM_FORMAT_S16;
+                }
+                else if (strcmp(argv[i], "s24") == 0)
+                {
+                    preferred_format = SND_PCM_FORMAT_S24;
+                }
+                else if (strcmp(argv[i], "s32") == 0)
+                {
+                    preferred_format = SND_PCM_FORMAT_S32;
+                }
+                else if (strcmp(argv[i], "float") == 0)
+                {
+                    preferred_format = SND_PCM_FORMAT_FLOAT;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--dither") == 0)
+        {
+            use_dither = 1;
+        }
+        else if (strcmp(argv[i], "--src-quality") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                src_quality = atoi(argv[i]);
+                if (src_quality < 0) src_quality = 0;
+                if (src_quality > 3) src_quality = 3;
+            }
+        }
+        else if (strcmp(argv[i], "--engines") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 1 && j <= MAX_ENGINES)
+                {
+                    num_engines = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--distribute") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                if (strcmp(argv[i], "channels") == 0)
+                {
+                    distribute_voices = 0;
+                }
+                else if (strcmp(argv[i], "voices") == 0)
+                {
+                    distribute_voices = 1;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--channel-map") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                const char *list;
+                char *end;
+
+                i++;
+                list = argv[i];
+                for (j = 0; j < 16 && *list != 0; j++)
+                {
+                    channel_map[j] = strtol(list, &end, 10);
+                    if (end == list || channel_map[j] < 0)
+                    {
+                        channel_map[j] = -1;
+                        break;
+                    }
+
+                    list = (*end == ',') ? end + 1 : end;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--isolate") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 1 && j <= MAX_PORTS)
+                {
+                    isolate_clients = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--pool") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 1 && j <= MAX_PORTS)
+                {
+                    pool_size = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--note-timeout") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j > 0)
+                {
+                    note_timeout = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch_blocks = 1;
+        }
+        else if (strcmp(argv[i], "--render-ahead") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 0)
+                {
+                    render_ahead = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--close-idle") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j > 0 && j <= 86400)
+                {
+                    close_timeout = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--skip-silence") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                j = atoi(argv[i]);
+                if (j >= 0 && j <= 32767)
+                {
+                    skip_silence = j;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--port-engines") == 0)
+        {
+            separate_port_engines = 1;
+        }
+        else if (strcmp(argv[i], "--worker-cpus") == 0)
+        {
+            if ((i + 1) < argc)
+            {
+                i++;
+                if (parse_cpu_list(argv[i], &worker_cpus) == 0 && CPU_COUNT(&worker_cpus) > 0)
+                {
+                    use_worker_cpus = 1;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--help") == 0)
+        {
+            usage(argv[0]);
+        }
+    }
+
+    if (num_pcm_devices == 0)
+    {
+        pcm_devices[0] = "default";
+        num_pcm_devices = 1;
+    }
+}
+
+
+static int dls_read_at(void *handle, void *buf, int offset, int size)
+{
+    int dls_size;
+
+    dls_size = ((dls_file_handle_t *)handle)->dls_size;
+    if ((offset < 0) || (offset >= dls_size)) return 0;
+    if (size > dls_size - offset) size = dls_size - offset;
+
+    memcpy(buf, offset + ((dls_file_handle_t *)handle)->dls_address, size);
+
+    return size;
+}
+
+static int dls_get_size(void *handle)
+{
+    return ((dls_file_handle_t *)handle)->dls_size;
+}
+
+static int load_dls_file(EAS_DATA_HANDLE data_handle)
+{
+    int dls_fd;
+    struct stat statbuf;
+    dls_file_handle_t dls_file_handle;
+    EAS_FILE eas_file;
+    EAS_RESULT res;
+
+    dls_fd = open(dls_filepath, O_RDONLY);
+    if (dls_fd < 0)
+    {
+        char *dlspathcopy, *slash, *filename;
+        DIR *dir;
+        struct dirent *entry;
+
+        dlspathcopy = strdup(dls_filepath);
+        if (dlspathcopy == NULL) return -1;
+
+        slash = strrchr(dlspathcopy, '/');
+        if (slash != NULL)
+        {
+            filename = slash + 1;
+            if (slash != dlspathcopy)
+            {
+                *slash = 0;
+                dir = opendir(dlspathcopy);
+                *slash = '/';
+            }
+            else
+            {
+                dir = opendir("/");
+            }
+        }
+        else
+        {
+            filename = dlspathcopy;
+            dir = opendir(".");
+        }
+
+        if (dir == NULL)
+        {
+            free(dlspathcopy);
+            return -2;
+        }
+
+        while (1)
+        {
+            entry = readdir(dir);
+            if (entry == NULL) break;
+
+            if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG && entry->d_type != DT_LNK) continue;
+
+            if (0 != strcasecmp(filename, entry->d_name)) continue;
+
+            strcpy(filename, entry->d_name);
+            break;
+        };
+
+        closedir(dir);
+
+        if (entry == NULL)
+        {
+            free(dlspathcopy);
+            return -3;
+        }
+
+        dls_fd = open(dlspathcopy, O_RDONLY);
+
+        free(dlspathcopy);
+
+        if (dls_fd < 0)
+        {
+            return -4;
+        }
+    }
+
+    if (fstat(dls_fd, &statbuf) < 0)
+    {
+        close(dls_fd);
+        return -5;
+    }
+
+    dls_file_handle.dls_size = statbuf.st_size;
+    dls_file_handle.dls_address = (uint8_t *) mmap(NULL, dls_file_handle.dls_size, PROT_READ, MAP_PRIVATE, dls_fd, 0);
+
+    close(dls_fd);
+
+    if (dls_file_handle.dls_address == MAP_FAILED)
+    {
+        return -6;
+    }
+
+    eas_file.handle = &dls_file_handle;
+    eas_file.readAt = dls_read_at;
+    eas_file.size = dls_get_size;
+
+    res = EAS_LoadDLSCollection(data_handle, NULL, &eas_file);
+
+    munmap(dls_file_handle.dls_address, dls_file_handle.dls_size);
+
+    if (res != EAS_SUCCESS)
+    {
+        return -7;
+    }
+
+    return 0;
+}
+
+
+static void shutdown_engine(synth_engine_t *engine);
+
+static int init_engine(synth_engine_t *engine, const S_EAS_LIB_CONFIG *eas_config)
+{
+    EAS_RESULT res;
+    int stream;
+
+    // initialize EAS
+    res = EAS_Init(&(engine->data_handle));
+    if (res != EAS_SUCCESS)
+    {
+        fprintf(stderr, "Error initializing EAS: %i\n", (int)res);
+        engine->data_handle = NULL;
+        return -2;
+    }
+
+    if (dls_filepath != NULL && *dls_filepath != 0)
+    {
+        if (load_dls_file(engine->data_handle) < 0)
+        {
+            fprintf(stderr, "Error loading DLS file: %s\n", dls_filepath);
+            EAS_Shutdown(engine->data_handle);
+            engine->data_handle = NULL;
+            return -3;
+        }
+    }
+
+    // set master volume
+    if (master_volume >= 0)
+    {
+        EAS_SetVolume(engine->data_handle, NULL, master_volume);
+    }
+
+    // set polyphony
+    if ((engine_polyphony > 0) && (engine_polyphony <= eas_config->maxVoices))
+    {
+        EAS_SetSynthPolyphony(engine->data_handle, EAS_MCU_SYNTH, engine_polyphony);
+    }
+
+    // set reverb
+    if (reverb_preset == 0)
+    {
+        EAS_SetParameter(engine->data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_BYPASS, EAS_TRUE);
+    }
+    else
+    {
+        EAS_SetParameter(engine->data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_BYPASS, EAS_FALSE);
+        EAS_SetParameter(engine->data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_PRESET, reverb_preset - 1);
+        if (reverb_wet >= 0)
+        {
+            EAS_SetParameter(engine->data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_WET, reverb_wet);
+        }
+    }
+
+    // set chorus
+    if (chorus_preset == 0)
+    {
+        EAS_SetParameter(engine->data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_BYPASS, EAS_TRUE);
+    }
+    else
+    {
+        EAS_SetParameter(engine->data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_BYPASS, EAS_FALSE);
+        EAS_SetParameter(engine->data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_PRESET, chorus_preset - 1);
+        if (chorus_rate >= 0)
+        {
+            EAS_SetParameter(engine->data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_RATE, chorus_rate);
+        }
+        if (chorus_depth >= 0)
+        {
+            EAS_SetParameter(engine->data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_DEPTH, chorus_depth);
+        }
+        if (chorus_level >= 0)
+        {
+            EAS_SetParameter(engine->data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_LEVEL, chorus_level);
+        }
+    }
+
+    // open midi streams (one for each port, when the ports share the engine)
+    for (stream = 0; stream < streams_per_engine; stream++)
+    {
+        res = EAS_OpenMIDIStream(engine->data_handle, &(engine->stream_handle[stream]), NULL);
+        if (res != EAS_SUCCESS)
+        {
+            fprintf(stderr, "Error opening EAS midi stream %i: %i\n", stream, (int)res);
+            while (stream > 0)
+            {
+                stream--;
+                EAS_CloseMIDIStream(engine->data_handle, engine->stream_handle[stream]);
+            }
+            EAS_Shutdown(engine->data_handle);
+            engine->data_handle = NULL;
+            return -4;
+        }
+
+        engine->emitted_status[stream] = 0;
+    }
+
+    engine->active_notes = 0;
+    memset(engine->held_notes, 0, sizeof(engine->held_notes));
+    memset(engine->sustain, 0, sizeof(engine->sustain));
+    engine->num_held = 0;
+    engine->silent_blocks = 0;
+    engine->idle = 0;
+    engine->buffer = NULL;
+
+    if (num_engines > 1)
+    {
+        engine->buffer = (EAS_PCM *) aligned_alloc(16, (bytes_per_call + 15) & ~15);
+        if (engine->buffer == NULL)
+        {
+            fprintf(stderr, "Error allocating engine buffer\n");
+            shutdown_engine(engine);
+            return -5;
+        }
+
+    }
+
+    return 0;
+}
+
+static void shutdown_engine(synth_engine_t *engine)
+{
+    int stream;
+
+    if (engine->data_handle == NULL)
+    {
+        return;
+    }
+
+    // close midi streams
+    for (stream = 0; stream < streams_per_engine; stream++)
+    {
+        EAS_CloseMIDIStream(engine->data_handle, engine->stream_handle[stream]);
+    }
+
+    // shutdown EAS
+    EAS_Shutdown(engine->data_handle);
+
+    free(engine->buffer);
+    engine->buffer = NULL;
+    engine->data_handle = NULL;
+}
+
+static int init_input_engines(midi_input_t *input)
+{
+    int engine, res;
+
+    for (engine = input->first_engine; engine < input->first_engine + engines_per_input; engine++)
+    {
+        res = init_engine(&(engines[engine]), EAS_Config());
+        if (res < 0)
+        {
+            while (engine > input->first_engine)
+            {
+                engine--;
+                shutdown_engine(&(engines[engine]));
+            }
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+
+static void stop_synth(void);
+
+static int start_synth(void) __attribute__((noinline));
+static int start_synth(void)
+{
+    const S_EAS_LIB_CONFIG *eas_config;
+    int index, res;
+
+    eas_config = EAS_Config();
+
+    num_channels = eas_config->numChannels;
+    frequency = eas_config->sampleRate;
+    samples_per_call = eas_config->mixBufferSize;
+    bytes_per_call = samples_per_call * num_channels * sizeof(EAS_PCM);
+    // silence must last at least 100 ms
+    idle_blocks = (frequency / 10 + samples_per_call - 1) / samples_per_call;
+
+    if (latency_periods > 0)
+    {
+        num_subbuffers = latency_periods;
+    }
+    else if (latency_ms > 0)
+    {
+        num_subbuffers = (latency_ms * (int64_t)frequency + 1000 * (int64_t)samples_per_call - 1) / (1000 * (int64_t)samples_per_call);
+    }
+    else
+    {
+        num_subbuffers = (4096 * (int64_t)frequency) / (11025 * (int64_t)samples_per_call);
+    }
+    if (num_subbuffers > 65536 / bytes_per_call)
+    {
+        num_subbuffers = 65536 / bytes_per_call;
+    }
+    if (latency_ms > 0 && num_subbuffers < 3)
+    {
+        num_subbuffers = 3;
+    }
+    if (num_subbuffers < 3)
+    {
+        fprintf(stderr, "Unsupported EAS parameters: %i, %i, %i\n", num_channels, frequency, samples_per_call);
+        return -1;
+    }
+
+    // rendered blocks are kept in subbuffers
+    if (render_ahead > (int)num_subbuffers)
+    {
+        render_ahead = num_subbuffers;
+    }
+
+    if (isolate_clients)
+    {
+        // each synth instance has own event ring and engines
+        num_inputs = isolate_clients;
+        separate_port_engines = 1;
+    }
+
+    // prepare event rings
+    for (index = 0; index < num_inputs; index++)
+    {
+        midi_input_t *input;
+
+        input = &(inputs[index]);
+        input->ring = (event_ring_t *) aligned_alloc(CACHE_LINE_SIZE, sizeof(event_ring_t));
+        if (input->ring == NULL)
+        {
+            fprintf(stderr, "Error allocating event buffer\n");
+            return -5;
+        }
+
+        atomic_init(&(input->ring->write_index), 0);
+        atomic_init(&(input->ring->read_index), 0);
+        input->ring->pending_index = 0;
+        input->ring->cached_read_index = 0;
+        input->ring->write_status = 0;
+        input->ring->cached_write_index = 0;
+        input->ring->read_status = 0;
+        memset(input->ring->last_event, 0xff, sizeof(input->ring->last_event));
+
+        input->spill.buffer = NULL;
+        input->spill.read_offset = 0;
+        input->spill.write_offset = 0;
+        if (overflow_policy == OVERFLOW_SPILL)
+        {
+            input->spill.buffer = (uint8_t *) malloc(SPILL_BUFFER_SIZE);
+            if (input->spill.buffer == NULL)
+            {
+                fprintf(stderr, "Error allocating spill buffer\n");
+                return -5;
+            }
+        }
+
+        input->client = -1;
+        input->subscriptions = 0;
+
+        memset(input->note_engine, 0xff, sizeof(input->note_engine));
+        memset(input->note_sustained, 0, sizeof(input->note_sustained));
+        memset(input->channel_sustain, 0, sizeof(input->channel_sustain));
+    }
+
+    engine_polyphony = polyphony;
+    if (distribute_voices)
+    {
+        // polyphony above the limit of one engine is split between several engines
+        if (num_engines == 0)
+        {
+            num_engines = (polyphony + eas_config->maxVoices - 1) / eas_config->maxVoices;
+            if (num_engines > MAX_ENGINES)
+            {
+                num_engines = MAX_ENGINES;
+            }
+        }
+        if (num_engines > 1 && polyphony > 0)
+        {
+            engine_polyphony = (polyphony + num_engines - 1) / num_engines;
+        }
+    }
+    if (num_engines == 0)
+    {
+        num_engines = 1;
+    }
+    if (engine_polyphony > eas_config->maxVoices)
+    {
+        fprintf(stderr, "Polyphony %i exceeds maximum of EAS engine (%i)\n", engine_polyphony, (int)eas_config->maxVoices);
+    }
+
+    if (num_engines > 1 && !distribute_voices)
+    {
+        for (index = 0; index < 16; index++)
+        {
+            if (channel_map[index] < 0)
+            {
+                channel_map[index] = index % num_engines;
+            }
+            else if (channel_map[index] >= num_engines)
+            {
+                fprintf(stderr, "Channel %i mapped to nonexistent engine: %i\n", index + 1, channel_map[index]);
+                return -6;
+            }
+        }
+    }
+
+    // ports either share the engines (each port uses own midi stream in every engine) or each port has own engines
+    engines_per_input = num_engines;
+    if (separate_port_engines && num_inputs > 1)
+    {
+        if (engines_per_input * num_inputs > MAX_ENGINES)
+        {
+            fprintf(stderr, "Too many engines: %i\n", engines_per_input * num_inputs);
+            return -7;
+        }
+
+        num_engines = engines_per_input * num_inputs;
+        streams_per_engine = 1;
+    }
+    else
+    {
+        streams_per_engine = num_inputs;
+    }
+
+    for (index = 0; index < num_inputs; index++)
+    {
+        inputs[index].first_engine = (streams_per_engine == 1) ? index * engines_per_input : 0;
+        inputs[index].stream = (streams_per_engine == 1) ? 0 : index;
+    }
+
+    for (index = 0; index < num_engines; index++)
+    {
+        engines[index].data_handle = NULL;
+        if (num_engines > 1)
+        {
+            sem_init(&(engines[index].render_start), 0, 0);
+            sem_init(&(engines[index].render_done), 0, 0);
+        }
+    }
+
+    // when isolating clients, only the instances in the pool are initialized now, the rest is initialized by pool thread when needed
+    num_free_inputs = 0;
+    memset(client_input, 0xff, sizeof(client_input));
+    sem_init(&pool_sem, 0, 0);
+
+    if (pool_size <= 0 || pool_size > num_inputs)
+    {
+        pool_size = num_inputs;
+    }
+
+    for (index = 0; index < num_inputs; index++)
+    {
+        if (!isolate_clients)
+        {
+            atomic_init(&(inputs[index].state), INPUT_ACTIVE);
+        }
+        else if (index < pool_size)
+        {
+            res = init_input_engines(&(inputs[index]));
+            if (res < 0)
+            {
+                stop_synth();
+                return res;
+            }
+
+            atomic_init(&(inputs[index].state), INPUT_FREE);
+            free_inputs[num_free_inputs] = index;
+            num_free_inputs++;
+        }
+        else
+        {
+            atomic_init(&(inputs[index].state), INPUT_UNUSED);
+        }
+    }
+
+    if (!isolate_clients)
+    {
+        for (index = 0; index < num_engines; index++)
+        {
+            res = init_engine(&(engines[index]), eas_config);
+            if (res < 0)
+            {
+                stop_synth();
+                return res;
+            }
+        }
+    }
+
+    subbuf_counter = 0;
+    memset(midi_buffer, 0, 65536);
+
+
+    return 0;
+}
+
+static void stop_synth(void)
+{
+    int index;
+
+    for (index = 0; index < num_engines; index++)
+    {
+        shutdown_engine(&(engines[index]));
+    }
+}
+
+static int run_as_daemon(void) __attribute__((noinline));
+static int run_as_daemon(void)
+{
+    int err;
+
+    printf("Running as daemon...\n");
+
+    err = daemon(0, 0);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error running as daemon: %i\n", err);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_midi_port(void) __attribute__((noinline));
+static int open_midi_port(void)
+{
+    int err, index;
+    unsigned int caps, type;
+
+    err = snd_seq_open(&midi_seq, seq_device, SND_SEQ_OPEN_DUPLEX, 0);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error opening ALSA sequencer %s: %i\n%s\n", seq_device, err, snd_strerror(err));
+        return -1;
+    }
+
+    err = snd_seq_set_client_name(midi_seq, midi_name);
+    if (err < 0)
+    {
+        snd_seq_close(midi_seq);
+        fprintf(stderr, "Error setting sequencer client name: %i\n%s\n", err, snd_strerror(err));
+        return -2;
+    }
+
+    caps = SND_SEQ_PORT_CAP_SUBS_WRITE | SND_SEQ_PORT_CAP_WRITE;
+    type = SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_MIDI_GM | SND_SEQ_PORT_TYPE_SYNTHESIZER;
+    // when isolating clients, all clients use the same port
+    for (index = 0; index < (isolate_clients ? 1 : num_inputs); index++)
+    {
+        char name[64];
+
+        if (index == 0)
+        {
+            strcpy(name, port_name);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%s %i", port_name, index + 1);
+        }
+
+        err = snd_seq_create_simple_port(midi_seq, name, caps, type);
+        if (err < 0)
+        {
+            snd_seq_close(midi_seq);
+            fprintf(stderr, "Error creating sequencer port: %i\n%s\n", err, snd_strerror(err));
+            return -3;
+        }
+        inputs[index].port_id = err;
+
+        printf("%s ALSA address is %i:%i\n", midi_name, snd_seq_client_id(midi_seq), err);
+    }
+
+    return 0;
+}
+
+static void close_midi_port(void)
+{
+    int index;
+
+    for (index = 0; index < (isolate_clients ? 1 : num_inputs); index++)
+    {
+        snd_seq_delete_port(midi_seq, inputs[index].port_id);
+    }
+    snd_seq_close(midi_seq);
+}
+
+
+static unsigned int greatest_common_divisor(unsigned int a, unsigned int b)
+{
+    while (b != 0)
+    {
+        unsigned int c;
+
+        c = a % b;
+        a = b;
+        b = c;
+    };
+
+    return a;
+}
+
+static void free_resampler(void)
+{
+    resampler.active = 0;
+    free(resampler.coefs);
+    free(resampler.input);
+    free(resampler.output);
+    resampler.coefs = NULL;
+    resampler.input = NULL;
+    resampler.output = NULL;
+}
+
+static int init_resampler(unsigned int input_rate, unsigned int output_rate, int quality)
+{
+    static const float rolloff[4] = { 0.0f, 0.80f, 0.90f, 0.95f };
+    unsigned int divisor, phase, tap, length;
+    double cutoff;
+
+    free_resampler();
+
+    divisor = greatest_common_divisor(input_rate, output_rate);
+    resampler.up = output_rate / divisor;
+    resampler.down = input_rate / divisor;
+    if (resampler.up > RESAMPLER_MAX_PHASES)
+    {
+        return -1;
+    }
+
+    resampler.taps = 8 << (quality - 1);
+    resampler.phase = 0;
+    resampler.position = resampler.taps - 1;
+    resampler.max_output = (samples_per_call * (uint64_t)resampler.up + resampler.down - 1) / resampler.down + 1;
+
+    resampler.coefs = (float *) aligned_alloc(16, resampler.up * resampler.taps * sizeof(float));
+    resampler.input = (float *) calloc(num_channels * (resampler.taps - 1 + samples_per_call), sizeof(float));
+    resampler.output = (float *) malloc(resampler.max_output * num_channels * sizeof(float));
+    if (resampler.coefs == NULL || resampler.input == NULL || resampler.output == NULL)
+    {
+        free_resampler();
+        return -2;
+    }
+
+    // windowed sinc lowpass filter at the upsampled rate, with cutoff below the lower of both nyquist frequencies
+    cutoff = ((resampler.up >= resampler.down) ? 0.5 : (0.5 * resampler.up) / resampler.down) * rolloff[quality] / resampler.up;
+    length = resampler.taps * resampler.up;
+
+    for (phase = 0; phase < resampler.up; phase++)
+    {
+        double sum;
+
+        sum = 0;
+        for (tap = 0; tap < resampler.taps; tap++)
+        {
+            unsigned int index;
+            double t, value;
+
+            index = phase + tap * resampler.up;
+            t = index - (length - 1) / 2.0;
+            value = (t == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+            // blackman window
+            value *= 0.42 - 0.5 * cos((2 * M_PI * index) / (length - 1)) + 0.08 * cos((4 * M_PI * index) / (length - 1));
+
+            resampler.coefs[phase * resampler.taps + (resampler.taps - 1 - tap)] = value;
+            sum += value;
+        }
+
+        // normalize gain of each phase
+        for (tap = 0; tap < resampler.taps; tap++)
+        {
+            resampler.coefs[phase * resampler.taps + tap] /= sum;
+        }
+    }
+
+    resampler.active = 1;
+
+    return 0;
+}
+
+static float dot_product(const float *coefs, const float *samples, unsigned int taps)
+{
+    v4sf sum;
+    unsigned int tap;
+
+    sum = (v4sf){ 0.0f, 0.0f, 0.0f, 0.0f };
+    for (tap = 0; tap < taps; tap += 4)
+    {
+        sum += *(const v4sf *)(coefs + tap) * *(const v4sf_unaligned *)(samples + tap);
+    }
+
+    return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+// convert samples from EAS to pcm format
+static void convert_samples(const EAS_PCM *input, uint8_t *output, unsigned int num_samples)
+{
+    unsigned int index;
+
+    switch (pcm_format)
+    {
+        case SND_PCM_FORMAT_S32:
+        case SND_PCM_FORMAT_S24:
+        {
+            int32_t *output32, scale;
+
+            // S24 uses lower 24 bits of 32-bit sample
+            output32 = (int32_t *) output;
+            scale = (pcm_format == SND_PCM_FORMAT_S32) ? 65536 : 256;
+            for (index = 0; index + 4 <= num_samples; index += 4)
+            {
+                *(v4si_unaligned *)(output32 + index) = __builtin_convertvector(*(const v4hi *)(input + index), v4si) * scale;
+            }
+            for (; index < num_samples; index++)
+            {
+                output32[index] = input[index] * scale;
+            }
+            break;
+        }
+
+        case SND_PCM_FORMAT_FLOAT:
+        {
+            float *output_float;
+
+            output_float = (float *) output;
+            for (index = 0; index + 4 <= num_samples; index += 4)
+            {
+                *(v4sf_unaligned *)(output_float + index) = __builtin_convertvector(__builtin_convertvector(*(const v4hi *)(input + index), v4si), v4sf) * (1.0f / 32768.0f);
+            }
+            for (; index < num_samples; index++)
+            {
+                output_float[index] = input[index] * (1.0f / 32768.0f);
+            }
+            break;
+        }
+
+        default:
+            memcpy(output, input, num_samples * sizeof(EAS_PCM));
+            break;
+    }
+}
+
+// triangular dither noise in range (-1, 1)
+static v4sf get_tpdf_dither(void)
+{
+    v4si random1, random2;
+
+    // xorshift generators
+    dither_state ^= dither_state << 13;
+    dither_state ^= dither_state >> 17;
+    dither_state ^= dither_state << 5;
+    random1 = (v4si)(dither_state >> 9);
+
+    dither_state ^= dither_state << 13;
+    dither_state ^= dither_state >> 17;
+    dither_state ^= dither_state << 5;
+    random2 = (v4si)(dither_state >> 9);
+
+    return __builtin_convertvector(random1 - random2, v4sf) * (1.0f / 8388608.0f);
+}
+
+static v4sf clamp_samples(v4sf value)
+{
+    v4si mask;
+
+    mask = value > 32767.0f;
+    value = (v4sf)(((v4si)value & ~mask) | ((v4si)(v4sf){ 32767.0f, 32767.0f, 32767.0f, 32767.0f } & mask));
+    mask = value < -32768.0f;
+    value = (v4sf)(((v4si)value & ~mask) | ((v4si)(v4sf){ -32768.0f, -32768.0f, -32768.0f, -32768.0f } & mask));
+
+    return value;
+}
+
+// convert resampled samples to pcm format (with optional dither when converting to 16 bits)
+static void convert_float_samples(const float *input, uint8_t *output, unsigned int num_samples)
+{
+    unsigned int index, remaining;
+    v4sf value;
+
+    for (index = 0; index < num_samples; index += 4)
+    {
+        remaining = num_samples - index;
+        if (remaining >= 4)
+        {
+            value = *(const v4sf_unaligned *)(input + index);
+        }
+        else
+        {
+            // last samples
+            value = (v4sf){ input[index], (remaining > 1) ? input[index + 1] : 0.0f, (remaining > 2) ? input[index + 2] : 0.0f, 0.0f };
+        }
+
+        switch (pcm_format)
+        {
+            case SND_PCM_FORMAT_S32:
+            case SND_PCM_FORMAT_S24:
+            {
+                v4si samples;
+
+                samples = __builtin_convertvector(clamp_samples(value) * ((pcm_format == SND_PCM_FORMAT_S32) ? 65536.0f : 256.0f), v4si);
+                if (remaining >= 4)
+                {
+                    *(v4si_unaligned *)((int32_t *)output + index) = samples;
+                }
+                else
+                {
+                    memcpy((int32_t *)output + index, &samples, remaining * sizeof(int32_t));
+                }
+                break;
+            }
+
+            case SND_PCM_FORMAT_FLOAT:
+                value = clamp_samples(value) * (1.0f / 32768.0f);
+                if (remaining >= 4)
+                {
+                    *(v4sf_unaligned *)((float *)output + index) = value;
+                }
+                else
+                {
+                    memcpy((float *)output + index, &value, remaining * sizeof(float));
+                }
+                break;
+
+            default:
+            {
+                v4hi samples;
+
+                if (use_dither)
+                {
+                    value += get_tpdf_dither();
+                }
+
+                // round to nearest integer
+                samples = __builtin_convertvector(__builtin_convertvector(clamp_samples(value) + 32768.5f, v4si) - 32768, v4hi);
+                if (remaining >= 4)
+                {
+                    *(v4hi *)((int16_t *)output + index) = samples;
+                }
+                else
+                {
+                    memcpy((int16_t *)output + index, &samples, remaining * sizeof(int16_t));
+                }
+                break;
+            }
+        }
+    }
+}
+
+// resample one block from EAS, returns number of output frames
+static unsigned int resample_block(const EAS_PCM *block, uint8_t *output)
+{
+    unsigned int channel, frame, num_output, history;
+    uint64_t start_time;
+
+    start_time = get_time_ns();
+    history = resampler.taps - 1;
+
+    for (channel = 0; channel < num_channels; channel++)
+    {
+        float *input;
+
+        input = resampler.input + channel * (history + samples_per_call) + history;
+        for (frame = 0; frame < samples_per_call; frame++)
+        {
+            input[frame] = block[frame * num_channels + channel];
+        }
+    }
+
+    num_output = 0;
+    while (resampler.position < history + samples_per_call)
+    {
+        const float *coefs;
+
+        coefs = resampler.coefs + resampler.phase * resampler.taps;
+        for (channel = 0; channel < num_channels; channel++)
+        {
+            resampler.output[num_output * num_channels + channel] = dot_product(coefs, resampler.input + channel * (history + samples_per_call) + resampler.position - history, resampler.taps);
+        }
+        num_output++;
+
+        resampler.phase += resampler.down;
+        resampler.position += resampler.phase / resampler.up;
+        resampler.phase %= resampler.up;
+    };
+
+    // keep last input frames for next block
+    resampler.position -= samples_per_call;
+    for (channel = 0; channel < num_channels; channel++)
+    {
+        float *input;
+
+        input = resampler.input + channel * (history + samples_per_call);
+        memmove(input, input + samples_per_call, history * sizeof(float));
+    }
+
+    convert_float_samples(resampler.output, output, num_output * num_channels);
+
+    stat_add(&stats.resampler_time, get_time_ns() - start_time);
+    stat_add(&stats.resampled_frames, num_output);
+
+    return num_output;
+}
+
+static void set_render_margin(unsigned int margin)
+{
+    if (margin > pcm_buffer_size - block_frames)
+    {
+        margin = pcm_buffer_size - block_frames;
+    }
+    if (margin < block_frames)
+    {
+        margin = block_frames;
+    }
+
+    render_margin = margin;
+    render_threshold = pcm_buffer_size - render_margin + block_frames;
+
+    atomic_store_explicit(&stats.render_margin, render_margin, memory_order_relaxed);
+}
+
+static int set_hw_params(void)
+{
+    static const snd_pcm_format_t formats[] = { SND_PCM_FORMAT_S16, SND_PCM_FORMAT_S32, SND_PCM_FORMAT_S24, SND_PCM_FORMAT_FLOAT };
+    int err, dir;
+    unsigned int rate, index;
+    snd_pcm_uframes_t buffer_size, period_size;
+    snd_pcm_hw_params_t *pcm_hwparams;
+
+    snd_pcm_hw_params_alloca(&pcm_hwparams);
+
+    err = snd_pcm_hw_params_any(midi_pcm, pcm_hwparams);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error getting hwparams: %i\n%s\n", err, snd_strerror(err));
+        return -1;
+    }
+
+    pcm_mmap = 0;
+    if (use_mmap)
+    {
+        err = snd_pcm_hw_params_set_access(midi_pcm, pcm_hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+        if (err < 0)
+        {
+            fprintf(stderr, "Error setting mmap access, using read/write access: %i\n%s\n", err, snd_strerror(err));
+        }
+        else
+        {
+            pcm_mmap = 1;
+        }
+    }
+
+    if (!pcm_mmap)
+    {
+        err = snd_pcm_hw_params_set_access(midi_pcm, pcm_hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
+        if (err < 0)
+        {
+            fprintf(stderr, "Error setting access: %i\n%s\n", err, snd_strerror(err));
+            return -2;
+        }
+    }
+
+    // use the first format supported by the device, so no conversion plugin is necessary
+    pcm_format = SND_PCM_FORMAT_UNKNOWN;
+    if (preferred_format != SND_PCM_FORMAT_UNKNOWN && snd_pcm_hw_params_test_format(midi_pcm, pcm_hwparams, preferred_format) == 0)
+    {
+        pcm_format = preferred_format;
+    }
+    for (index = 0; pcm_format == SND_PCM_FORMAT_UNKNOWN && index < sizeof(formats) / sizeof(formats[0]); index++)
+    {
+        if (snd_pcm_hw_params_test_format(midi_pcm, pcm_hwparams, formats[index]) == 0)
+        {
+            pcm_format = formats[index];
+        }
+    }
+    if (pcm_format == SND_PCM_FORMAT_UNKNOWN)
+    {
+        pcm_format = SND_PCM_FORMAT_S16;
+    }
+
+    err = snd_pcm_hw_params_set_format(midi_pcm, pcm_hwparams, pcm_format);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting format: %i\n%s\n", err, snd_strerror(err));
+        return -3;
+    }
+
+    err = snd_pcm_hw_params_set_channels(midi_pcm, pcm_hwparams, num_channels);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting channels: %i\n%s\n", err, snd_strerror(err));
+        return -4;
+    }
+
+    if (src_quality > 0)
+    {
+        // use native rate of the device and resample using internal resampler
+        snd_pcm_hw_params_set_rate_resample(midi_pcm, pcm_hwparams, 0);
+    }
+
+    rate = frequency;
+    dir = 0;
+    err = snd_pcm_hw_params_set_rate_near(midi_pcm, pcm_hwparams, &rate, &dir);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting rate: %i\n%s\n", err, snd_strerror(err));
+        return -5;
+    }
+
+    pcm_rate = rate;
+    free_resampler();
+    if (rate != frequency)
+    {
+        if (src_quality == 0)
+        {
+            fprintf(stderr, "PCM rate (%u) differs from EAS rate (%u), resampling disabled\n", rate, frequency);
+        }
+        else if (init_resampler(frequency, rate, (src_quality < 0) ? 2 : src_quality) < 0)
+        {
+            fprintf(stderr, "Error initializing resampler: %u -> %u\n", frequency, rate);
+            return -10;
+        }
+        else
+        {
+            printf("Resampling from %u to %u (%u taps)\n", frequency, rate, resampler.taps);
+        }
+    }
+
+    block_frames = resampler.active ? resampler.max_output - 1 : samples_per_call;
+
+    pcm_frame_size = (snd_pcm_format_physical_width(pcm_format) / 8) * num_channels;
+    free(pcm_output_buffer);
+    pcm_output_buffer = (uint8_t *) malloc((resampler.active ? resampler.max_output : samples_per_call) * num_subbuffers * pcm_frame_size);
+    if (pcm_output_buffer == NULL)
+    {
+        fprintf(stderr, "Error allocating output buffer\n");
+        return -11;
+    }
+
+    buffer_size = block_frames * num_subbuffers;
+    err = snd_pcm_hw_params_set_buffer_size_near(midi_pcm, pcm_hwparams, &buffer_size);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting buffer size: %i\n%s\n", err, snd_strerror(err));
+        return -6;
+    }
+
+    period_size = block_frames;
+    dir = 0;
+    err = snd_pcm_hw_params_set_period_size_near(midi_pcm, pcm_hwparams, &period_size, &dir);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting period size: %i\n%s\n", err, snd_strerror(err));
+        return -7;
+    }
+
+    err = snd_pcm_hw_params(midi_pcm, pcm_hwparams);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting hwparams: %i\n%s\n", err, snd_strerror(err));
+        return -8;
+    }
+
+    if (pcm_hwparams_saved == NULL && snd_pcm_hw_params_malloc(&pcm_hwparams_saved) < 0)
+    {
+        pcm_hwparams_saved = NULL;
+        fprintf(stderr, "Error allocating hwparams\n");
+        return -12;
+    }
+    snd_pcm_hw_params_copy(pcm_hwparams_saved, pcm_hwparams);
+
+    snd_pcm_hw_params_get_buffer_size(pcm_hwparams, &buffer_size);
+    dir = 0;
+    snd_pcm_hw_params_get_period_size(pcm_hwparams, &period_size, &dir);
+    pcm_buffer_size = buffer_size;
+    pcm_period_size = period_size;
+
+    if (pcm_buffer_size < 2 * block_frames)
+    {
+        fprintf(stderr, "PCM buffer too small: %u\n", pcm_buffer_size);
+        return -9;
+    }
+
+    // by default keep the buffer filled except for two blocks
+    if (adaptive_margin)
+    {
+        // adaptive margin starts at the minimum and is raised after buffer underruns
+        set_render_margin(2 * block_frames);
+    }
+    else if (margin_ms > 0)
+    {
+        set_render_margin(((margin_ms * (int64_t)rate + 1000 * (int64_t)block_frames - 1) / (1000 * (int64_t)block_frames)) * block_frames);
+    }
+    else
+    {
+        set_render_margin(pcm_buffer_size - 2 * block_frames);
+    }
+
+    printf("PCM format: %s%s\n", snd_pcm_format_name(pcm_format), (use_dither && pcm_format == SND_PCM_FORMAT_S16 && resampler.active) ? " (dithered)" : "");
+    printf("PCM buffer: %u frames (%.1f ms), period: %u frames, render margin: %u frames (%.1f ms)\n",
+        pcm_buffer_size,
+        (pcm_buffer_size * 1000.0) / rate,
+        pcm_period_size,
+        render_margin,
+        (render_margin * 1000.0) / rate
+    );
+
+    return 0;
+}
+
+static int set_sw_params(void)
+{
+    snd_pcm_sw_params_t *swparams;
+    int err;
+
+    snd_pcm_sw_params_alloca(&swparams);
+
+    err = snd_pcm_sw_params_current(midi_pcm, swparams);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error getting swparams: %i\n%s\n", err, snd_strerror(err));
+        return -1;
+    }
+
+    // wake up from poll when the render loop can write data
+    err = snd_pcm_sw_params_set_avail_min(midi_pcm, swparams, render_threshold);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting avail min: %i\n%s\n", err, snd_strerror(err));
+        return -2;
+    }
+
+    err = snd_pcm_sw_params(midi_pcm, swparams);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error setting sw params: %i\n%s\n", err, snd_strerror(err));
+        return -3;
+    }
+
+    return 0;
+}
+
+// open pcm device and negotiate its parameters
+static int open_pcm_device(const char *name)
+{
+    int err;
+
+    // busy device fails immediately, so the next device from the list can be tried
+    err = snd_pcm_open(&midi_pcm, name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error opening PCM device %s: %i\n%s\n", name, err, snd_strerror(err));
+        midi_pcm = NULL;
+        return -1;
+    }
+
+    if (set_hw_params() < 0)
+    {
+        snd_pcm_close(midi_pcm);
+        midi_pcm = NULL;
+        return -2;
+    }
+
+    if (set_sw_params() < 0)
+    {
+        snd_pcm_close(midi_pcm);
+        midi_pcm = NULL;
+        return -3;
+    }
+
+    // set nonblock mode
+    snd_pcm_nonblock(midi_pcm, 1);
+
+    snd_pcm_prepare(midi_pcm);
+
+    return 0;
+}
+
+// open the first usable pcm device from the list
+static int open_pcm_output(void) __attribute__((noinline));
+static int open_pcm_output(void)
+{
+    int index;
+
+    for (index = 0; index < num_pcm_devices; index++)
+    {
+        if (open_pcm_device(pcm_devices[index]) == 0)
+        {
+            pcm_device_index = index;
+            if (index == 0)
+            {
+                printf("Using PCM device %s\n", pcm_devices[index]);
+            }
+            else
+            {
+                printf("Using PCM device %s (fallback %i of %i, preceding devices failed)\n", pcm_devices[index], index, num_pcm_devices - 1);
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// reopen pcm device using previously negotiated parameters, or open the device list again
+static int reopen_pcm_output(void)
+{
+    int err;
+
+    // don't wait for the device when another application uses it
+    err = snd_pcm_open(&midi_pcm, pcm_devices[pcm_device_index], SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error reopening PCM device %s: %i\n%s\n", pcm_devices[pcm_device_index], err, snd_strerror(err));
+        midi_pcm = NULL;
+        return open_pcm_output();
+    }
+
+    err = snd_pcm_hw_params(midi_pcm, pcm_hwparams_saved);
+    if (err < 0)
+    {
+        fprintf(stderr, "Error restoring hwparams: %i\n%s\n", err, snd_strerror(err));
+        snd_pcm_close(midi_pcm);
+        midi_pcm = NULL;
+        return open_pcm_output();
+    }
+
+    if (set_sw_params() < 0)
+    {
+        snd_pcm_close(midi_pcm);
+        midi_pcm = NULL;
+        return open_pcm_output();
+    }
+
+    // set nonblock mode
+    snd_pcm_nonblock(midi_pcm, 1);
+
+    snd_pcm_prepare(midi_pcm);
+
+    return 0;
+}
+
+static void close_pcm_output(void)
+{
+    if (midi_pcm != NULL)
+    {
+        snd_pcm_close(midi_pcm);
+        midi_pcm = NULL;
+    }
+
+    if (pcm_hwparams_saved != NULL)
+    {
+        snd_pcm_hw_params_free(pcm_hwparams_saved);
+        pcm_hwparams_saved = NULL;
+    }
+
+    free(pcm_output_buffer);
+    pcm_output_buffer = NULL;
+}
+
+
+static int drop_privileges(void)
+{
+    uid_t uid;
+    gid_t gid;
+    const char *sudo_id;
+    long long int llid;
+    const char *xdg_dir;
+    char buf[32];
+    struct stat statbuf;
+    struct passwd *passwdbuf;
+
+    if (getuid() != 0)
+    {
+        return 0;
+    }
+
+    sudo_id = secure_getenv("SUDO_UID");
+    if (sudo_id == NULL)
+    {
+        sudo_id = secure_getenv("PKEXEC_UID");
+        if (sudo_id == NULL)
+        {
+            return -1;
+        }
+    }
+
+    errno = 0;
+    llid = strtoll(sudo_id, NULL, 10);
+    uid = (uid_t) llid;
+    if (errno != 0 || uid == 0 || llid != (long long int)uid)
+    {
+        return -2;
+    }
+
+    gid = getgid();
+    if (gid == 0)
+    {
+        sudo_id = secure_getenv("SUDO_GID");
+        if (sudo_id == NULL)
+        {
+            passwdbuf = getpwuid(uid);
+            if (passwdbuf != NULL)
+            {
+                gid = passwdbuf->pw_gid;
+            }
+
+            if (gid == 0)
+            {
+                return -3;
+            }
+        }
+        else
+        {
+            errno = 0;
+            llid = strtoll(sudo_id, NULL, 10);
+            gid = (gid_t) llid;
+            if (errno != 0 || gid == 0 || llid != (long long int)gid)
+            {
+                return -4;
+            }
+        }
+    }
+
+    if (setgid(gid) != 0)
+    {
+        return -5;
+    }
+    if (setuid(uid) != 0)
+    {
+        return -6;
+    }
+
+    printf("Dropped root privileges\n");
+
+    chdir("/");
+
+    // define some environment variables
+
+    xdg_dir = getenv("XDG_RUNTIME_DIR");
+    if ((xdg_dir == NULL) || (*xdg_dir == 0))
+    {
+        snprintf(buf, 32, "/run/user/%lli", (long long int)uid);
+
+        if ((stat(buf, &statbuf) == 0) && ((statbuf.st_mode & S_IFMT) == S_IFDIR) && (statbuf.st_uid == uid))
+        {
+            // if XDG_RUNTIME_DIR is not defined and directory /run/user/$USER exists then use it for XDG_RUNTIME_DIR
+            setenv("XDG_RUNTIME_DIR", buf, 1);
+
+            xdg_dir = getenv("XDG_CONFIG_HOME");
+            if ((xdg_dir == NULL) || (*xdg_dir == 0))
+            {
+                passwdbuf = getpwuid(uid);
+                if (passwdbuf != NULL)
+                {
+                    // also if XDG_CONFIG_HOME is not defined then define it as user's home directory
+                    setenv("XDG_CONFIG_HOME", passwdbuf->pw_dir, 1);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int create_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int err;
+    thread_start_t start;
+
+    err = pthread_attr_init(&attr);
+    if (err != 0)
+    {
+        fprintf(stderr, "Error creating thread attribute: %i\n", err);
+        return -1;
+    }
+
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    start.initialized = 0;
+    start.arg = arg;
+    err = pthread_create(thread, &attr, start_routine, (void *)&start);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "Error creating thread: %i\n", err);
+        return -2;
+    }
+
+    // wait for thread initialization
+    while (start.initialized == 0)
+    {
+        struct timespec req;
+
+        req.tv_sec = 0;
+        req.tv_nsec = 10000000;
+        nanosleep(&req, NULL);
+    };
+
+    return 0;
+}
+
+static void *render_thread_proc(void *arg);
+static void *render_ahead_thread_proc(void *arg);
+static void *worker_thread_proc(void *arg);
+static void *pool_thread_proc(void *arg);
+static int probe_latency(void);
+
+static int start_thread(void) __attribute__((noinline));
+static int start_thread(void)
+{
+    sigset_t mask;
+    int index;
+
+    // try to increase priority (only root)
+    nice(-20);
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0)
+    {
+        fprintf(stderr, "Error creating eventfd: %i\n", errno);
+        return -3;
+    }
+    atomic_init(&midi_event_written, 0);
+
+    // statistics are printed on SIGUSR1 - block the signal in all threads and receive it using signalfd
+    // (SIGUSR2 is sent by render thread when the render loop stops)
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0)
+    {
+        fprintf(stderr, "Error creating signalfd: %i\n", errno);
+        return -4;
+    }
+
+    midi_init_state = 0;
+
+    // threads are started before dropping root privileges, so they can set their scheduler
+    // (latency probe doesn't receive midi events)
+    if (probe_filepath == NULL && create_thread(&midi_thread, &midi_thread_proc, NULL) < 0)
+    {
+        return -1;
+    }
+
+    if (create_thread(&render_thread, &render_thread_proc, NULL) < 0)
+    {
+        midi_init_state = -1;
+        return -2;
+    }
+
+    if (render_ahead > 0 && probe_filepath == NULL)
+    {
+        // render-ahead worker is started by render thread after prefilling pcm buffer
+        sem_init(&render_ahead_free, 0, 0);
+        sem_init(&render_ahead_ready, 0, 0);
+
+        if (create_thread(&render_ahead_thread, &render_ahead_thread_proc, NULL) < 0)
+        {
+            midi_init_state = -1;
+            return -7;
+        }
+    }
+
+    for (index = 1; index < num_engines; index++)
+    {
+        if (create_thread(&(engines[index].thread), &worker_thread_proc, &(engines[index])) < 0)
+        {
+            midi_init_state = -1;
+            return -5;
+        }
+    }
+
+    if (isolate_clients)
+    {
+        if (create_thread(&pool_thread, &pool_thread_proc, NULL) < 0)
+        {
+            midi_init_state = -1;
+            return -6;
+        }
+    }
+
+    if (drop_privileges() < 0)
+    {
+        fprintf(stderr, "Error dropping root privileges\n");
+    }
+
+    return 0;
+}
+
+
+// returns status of the (first) midi message in the event and updates running status
+static uint8_t get_event_status(event_ring_t *ring, unsigned int index)
+{
+    uint8_t first;
+
+    first = ring->buffer[index & (EVENT_BUFFER_SIZE - 1)];
+    if (first < 0x80)
+    {
+        return ring->read_status;
+    }
+
+    ring->read_status = (first < 0xF0) ? first : 0;
+    return first;
+}
+
+// reads data bytes of the (first) midi message in the event
+static void get_message_data(const event_ring_t *ring, unsigned int offset, unsigned int length, uint8_t *data)
+{
+    if (ring->buffer[offset] >= 0x80)
+    {
+        offset++;
+        length--;
+    }
+    data[0] = (length > 0) ? ring->buffer[offset & (EVENT_BUFFER_SIZE - 1)] : 0;
+    data[1] = (length > 1) ? ring->buffer[(offset + 1) & (EVENT_BUFFER_SIZE - 1)] : 0;
+}
+
+// keep track of held notes in each midi stream of the engine and wake it up (when skipping silence)
+static void track_engine_notes(synth_engine_t *engine, int stream, const event_ring_t *ring, unsigned int offset, unsigned int length, uint8_t status)
+{
+    uint8_t data[2];
+    unsigned int channel, note;
+    uint64_t mask;
+
+    engine->idle = 0;
+    engine->silent_blocks = 0;
+
+    if (status < 0x80 || status >= 0xF0)
+    {
+        return;
+    }
+
+    get_message_data(ring, offset, length, data);
+    channel = status & 0x0F;
+    note = data[0] & 0x7F;
+    mask = (uint64_t)1 << (note & 63);
+
+    switch (status & 0xF0)
+    {
+        case 0x80:
+        case 0x90:
+            if ((status & 0xF0) == 0x90 && data[1] != 0)
+            {
+                if (!(engine->held_notes[stream][channel][note >> 6] & mask))
+                {
+                    engine->held_notes[stream][channel][note >> 6] |= mask;
+                    engine->num_held++;
+                }
+            }
+            else if (engine->held_notes[stream][channel][note >> 6] & mask)
+            {
+                engine->held_notes[stream][channel][note >> 6] &= ~mask;
+                engine->num_held--;
+            }
+            break;
+
+        case 0xB0:
+            if (data[0] == 64)
+            {
+                if (data[1] >= 64 && !(engine->sustain[stream] & (1 << channel)))
+                {
+                    engine->sustain[stream] |= 1 << channel;
+                    engine->num_held++;
+                }
+                else if (data[1] < 64 && (engine->sustain[stream] & (1 << channel)))
+                {
+                    engine->sustain[stream] &= ~(1 << channel);
+                    engine->num_held--;
+                }
+            }
+            else if (data[0] == 120 || data[0] == 123)
+            {
+                // all sound off / all notes off
+                for (note = 0; note < 128; note++)
+                {
+                    if (engine->held_notes[stream][channel][note >> 6] & ((uint64_t)1 << (note & 63)))
+                    {
+                        engine->num_held--;
+                    }
+                }
+                engine->held_notes[stream][channel][0] = 0;
+                engine->held_notes[stream][channel][1] = 0;
+            }
+            else if (data[0] == 121 && (engine->sustain[stream] & (1 << channel)))
+            {
+                // reset all controllers releases sustain pedal
+                engine->sustain[stream] &= ~(1 << channel);
+                engine->num_held--;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void write_engine_event(synth_engine_t *engine, int stream, event_ring_t *ring, unsigned int offset, unsigned int length, uint8_t status)
+{
+    if (skip_silence >= 0)
+    {
+        track_engine_notes(engine, stream, ring, offset, length, status);
+    }
+
+    if (ring->buffer[offset] < 0x80)
+    {
+        // event uses running status - if the previous event was dropped or sent to another engine, then the status must be sent
+        if (engine->emitted_status[stream] != status)
+        {
+            engine->emitted_status[stream] = status;
+            EAS_WriteMIDIStream(engine->data_handle, engine->stream_handle[stream], &status, 1);
+        }
+    }
+    else
+    {
+        engine->emitted_status[stream] = (ring->buffer[offset] < 0xF0) ? ring->buffer[offset] : 0;
+    }
+
+    if (length <= EVENT_BUFFER_SIZE - offset)
+    {
+        EAS_WriteMIDIStream(engine->data_handle, engine->stream_handle[stream], &(ring->buffer[offset]), length);
+    }
+    else
+    {
+        EAS_WriteMIDIStream(engine->data_handle, engine->stream_handle[stream], &(ring->buffer[offset]), EVENT_BUFFER_SIZE - offset);
+        EAS_WriteMIDIStream(engine->data_handle, engine->stream_handle[stream], &(ring->buffer[0]), length - (EVENT_BUFFER_SIZE - offset));
+    }
+}
+
+static void release_note(midi_input_t *input, unsigned int channel, unsigned int note)
+{
+    engines[input->note_engine[channel][note]].active_notes--;
+    input->note_engine[channel][note] = -1;
+    input->note_sustained[channel][note] = 0;
+}
+
+// returns engine which should receive the event when distributing voices, or -1 for all engines
+static int get_voice_engine(midi_input_t *input, unsigned int offset, unsigned int length, uint8_t status)
+{
+    const event_ring_t *ring;
+    uint8_t data[2];
+    unsigned int channel, note;
+    int engine, index;
+
+    ring = input->ring;
+
+    get_message_data(ring, offset, length, data);
+
+    channel = status & 0x0F;
+    note = data[0] & 0x7F;
+
+    switch (status & 0xF0)
+    {
+        case 0x90:
+            if (data[1] != 0)
+            {
+                if (input->note_engine[channel][note] < 0)
+                {
+                    // new note is played by the engine with the least sounding notes
+                    engine = input->first_engine;
+                    for (index = engine + 1; index < input->first_engine + engines_per_input; index++)
+                    {
+                        if (engines[index].active_notes < engines[engine].active_notes)
+                        {
+                            engine = index;
+                        }
+                    }
+
+                    input->note_engine[channel][note] = engine;
+                    engines[engine].active_notes++;
+                }
+
+                input->note_sustained[channel][note] = 0;
+                return input->note_engine[channel][note];
+            }
+            // fallthrough - note on with zero velocity is note off
+        case 0x80:
+            engine = input->note_engine[channel][note];
+            if (engine >= 0)
+            {
+                // note held by sustain pedal keeps sounding until the pedal is released
+                if (input->channel_sustain[channel])
+                {
+                    input->note_sustained[channel][note] = 1;
+                }
+                else
+                {
+                    release_note(input, channel, note);
+                }
+            }
+            return engine;
+        case 0xA0:
+            return input->note_engine[channel][note];
+        case 0xB0:
+            if (data[0] == 64)
+            {
+                input->channel_sustain[channel] = (data[1] >= 64);
+            }
+
+            // after releasing sustain pedal or all sound off / all notes off, notes are no longer counted
+            if ((data[0] == 64 && data[1] < 64) || data[0] == 120 || data[0] == 123)
+            {
+                for (note = 0; note < 128; note++)
+                {
+                    if (input->note_engine[channel][note] >= 0 && (data[0] != 64 || input->note_sustained[channel][note]))
+                    {
+                        release_note(input, channel, note);
+                    }
+                }
+            }
+            return -1;
+        default:
+            // other channel messages (controllers, program changes, ...) are mirrored to all engines
+            return -1;
+    }
+}
+
+static void emit_event(midi_input_t *input, unsigned int index, unsigned int length, uint8_t status)
+{
+    unsigned int offset;
+    int engine;
+
+    offset = index & (EVENT_BUFFER_SIZE - 1);
+
+    if (engines_per_input > 1 && status >= 0x80 && status < 0xF0)
+    {
+        // channel messages are passed to the engine which renders the channel (or plays the note)
+        engine = distribute_voices ? get_voice_engine(input, offset, length, status) : input->first_engine + channel_map[status & 0x0F];
+        if (engine >= 0)
+        {
+            write_engine_event(&(engines[engine]), input->stream, input->ring, offset, length, status);
+            return;
+        }
+    }
+
+    // system messages are passed to all engines of the port
+    for (engine = input->first_engine; engine < input->first_engine + engines_per_input; engine++)
+    {
+        write_engine_event(&(engines[engine]), input->stream, input->ring, offset, length, status);
+    }
+}
+
+static int is_continuous_controller(unsigned int controller)
+{
+    switch (controller)
+    {
+        case 1:     // modulation wheel
+        case 2:     // breath controller
+        case 4:     // foot controller
+        case 5:     // portamento time
+        case 7:     // channel volume
+        case 8:     // balance
+        case 10:    // pan
+        case 11:    // expression
+        case 12:    // effect control 1
+        case 13:    // effect control 2
+        case 16:    // general purpose controllers 1-4
+        case 17:
+        case 18:
+        case 19:
+        case 91:    // effects depths 1-5
+        case 92:
+        case 93:
+        case 94:
+        case 95:
+            return 1;
+        default:
+            // everything else (bank select, data entry, RPN/NRPN selection, switches, channel mode messages) depends on order
+            return 0;
+    }
+}
+
+// returns key of events which can be replaced by later event with the same key, or -1
+static int get_coalesce_key(const event_ring_t *ring, unsigned int index, unsigned int length, uint8_t status)
+{
+    unsigned int data_index;
+
+    // only events containing single midi message can be coalesced
+    data_index = index;
+    if (ring->buffer[index & (EVENT_BUFFER_SIZE - 1)] >= 0x80)
+    {
+        data_index++;
+        length--;
+    }
+
+    switch (status & 0xF0)
+    {
+        case 0xB0:
+            if (length == 2 && is_continuous_controller(ring->buffer[data_index & (EVENT_BUFFER_SIZE - 1)]))
+            {
+                return (status & 0x0F) * 130 + ring->buffer[data_index & (EVENT_BUFFER_SIZE - 1)];
+            }
+            break;
+        case 0xD0:
+            if (length == 1)
+            {
+                return (status & 0x0F) * 130 + COALESCE_KEY_CHANNEL_PRESSURE;
+            }
+            break;
+        case 0xE0:
+            if (length == 2)
+            {
+                return (status & 0x0F) * 130 + COALESCE_KEY_PITCH_BEND;
+            }
+            break;
+        default:
+            break;
+    }
+
+    return -1;
+}
+
+// pass collected events to EAS, leaving out events superseded by later events with the same key
+static void emit_coalesced_events(midi_input_t *input, unsigned int num_events, const unsigned int *event_index, const int16_t *event_key, const uint8_t *event_status)
+{
+    event_ring_t *ring;
+    unsigned int num;
+    event_header_t header;
+
+    ring = input->ring;
+
+    for (num = 0; num < num_events; num++)
+    {
+        if (event_key[num] >= 0 && ring->last_event[event_key[num]] != (int)num)
+        {
+            continue;
+        }
+
+        event_ring_get(ring, event_index[num], &header, sizeof(event_header_t));
+        emit_event(input, event_index[num] + sizeof(event_header_t), header.length, event_status[num]);
+    }
+
+    for (num = 0; num < num_events; num++)
+    {
+        if (event_key[num] >= 0)
+        {
+            ring->last_event[event_key[num]] = -1;
+        }
+    }
+}
+
+// pass events which arrived before deadline to EAS
+static void drain_event_ring(midi_input_t *input, uint64_t deadline)
+{
+    event_ring_t *ring;
+    unsigned int read_index, num_events;
+    event_header_t header;
+    unsigned int event_index[COALESCE_MAX_EVENTS];
+    int16_t event_key[COALESCE_MAX_EVENTS];
+    uint8_t event_status[COALESCE_MAX_EVENTS];
+
+    ring = input->ring;
+    read_index = atomic_load_explicit(&ring->read_index, memory_order_relaxed);
+    num_events = 0;
+
+    while (1)
+    {
+        uint8_t status;
+
+        if (read_index == ring->cached_write_index)
+        {
+            // refresh cached write index only when the ring looks empty
+            ring->cached_write_index = atomic_load_explicit(&ring->write_index, memory_order_acquire);
+            if (read_index == ring->cached_write_index)
+            {
+                break;
+            }
+        }
+
+        event_ring_get(ring, read_index, &header, sizeof(event_header_t));
+        if (header.time > deadline)
+        {
+            break;
+        }
+
+        status = get_event_status(ring, read_index + sizeof(event_header_t));
+
+        if (coalesce_events)
+        {
+            // collect events and pass them to EAS later
+            event_index[num_events] = read_index;
+            event_status[num_events] = status;
+            event_key[num_events] = get_coalesce_key(ring, read_index + sizeof(event_header_t), header.length, status);
+            if (event_key[num_events] >= 0)
+            {
+                ring->last_event[event_key[num_events]] = num_events;
+            }
+
+            num_events++;
+            if (num_events == COALESCE_MAX_EVENTS)
+            {
+                emit_coalesced_events(input, num_events, event_index, event_key, event_status);
+                num_events = 0;
+            }
+        }
+        else
+        {
+            emit_event(input, read_index + sizeof(event_header_t), header.length, status);
+        }
+
+        read_index += sizeof(event_header_t) + header.length;
+    };
+
+    if (num_events != 0)
+    {
+        emit_coalesced_events(input, num_events, event_index, event_key, event_status);
+    }
+
+    // release buffer space to producer
+    atomic_store_explicit(&ring->read_index, read_index, memory_order_release);
+}
+
+static void discard_event_ring(event_ring_t *ring)
+{
+    ring->cached_write_index = atomic_load_explicit(&ring->write_index, memory_order_acquire);
+    atomic_store_explicit(&ring->read_index, ring->cached_write_index, memory_order_release);
+}
+
+// returns the deadline for events rendered in the block, which will start playing after delay_frames
+static uint64_t get_block_deadline(uint64_t current_time, snd_pcm_sframes_t delay_frames)
+{
+    int64_t deadline_frames;
+
+    if (!event_timing || delay_frames < 0)
+    {
+        return UINT64_MAX;
+    }
+
+    // events are played with constant latency (render margin + one block) after they arrived,
+    // so the block contains events which arrived until (end of block) - (latency)
+    deadline_frames = (int64_t)delay_frames - render_margin;
+
+    return current_time + (deadline_frames * 1000000000) / (int64_t)pcm_rate;
+}
+
+// returns pointer to contiguous area of samples_per_call frames in pcm buffer, or NULL
+static EAS_PCM *begin_mmap_block(void)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t frames;
+    unsigned int channel;
+
+    frames = samples_per_call;
+    if (snd_pcm_mmap_begin(midi_pcm, &areas, &mmap_offset, &frames) < 0)
+    {
+        return NULL;
+    }
+
+    // area at the end of pcm buffer can be too short
+    if (frames < samples_per_call)
+    {
+        return NULL;
+    }
+
+    // check that the area has the same layout as output of EAS
+    for (channel = 0; channel < num_channels; channel++)
+    {
+        if ((areas[channel].addr != areas[0].addr) ||
+            (areas[channel].first != channel * 8 * sizeof(EAS_PCM)) ||
+            (areas[channel].step != num_channels * 8 * sizeof(EAS_PCM))
+           )
+        {
+            return NULL;
+        }
+    }
+
+    return (EAS_PCM *) ((uint8_t *)areas[0].addr + mmap_offset * num_channels * sizeof(EAS_PCM));
+}
+
+static int render_engine(synth_engine_t *engine, EAS_PCM *buffer)
+{
+    EAS_RESULT res;
+    EAS_I32 num_generated;
+
+    res = EAS_Render(engine->data_handle, buffer, samples_per_call, &num_generated);
+    if (res != EAS_SUCCESS) return -1;
+    if (num_generated != samples_per_call) return -2;
+
+    return 0;
+}
+
+// sum blocks rendered by the engines with saturation
+static void mix_engine_blocks(EAS_PCM *output, const int *mixed_engines, int num_mixed)
+{
+    unsigned int index, num_samples;
+    int engine;
+
+    num_samples = samples_per_call * num_channels;
+
+    for (index = 0; index + 4 <= num_samples; index += 4)
+    {
+        v4si sum, mask;
+
+        sum = (v4si){ 0, 0, 0, 0 };
+        for (engine = 0; engine < num_mixed; engine++)
+        {
+            sum += __builtin_convertvector(*(const v4hi *)(engines[mixed_engines[engine]].buffer + index), v4si);
+        }
+
+        mask = sum > 32767;
+        sum = (sum & ~mask) | (32767 & mask);
+        mask = sum < -32768;
+        sum = (sum & ~mask) | (-32768 & mask);
+
+        *(v4hi *)(output + index) = __builtin_convertvector(sum, v4hi);
+    }
+
+    for (; index < num_samples; index++)
+    {
+        int32_t sum;
+
+        sum = 0;
+        for (engine = 0; engine < num_mixed; engine++)
+        {
+            sum += engines[mixed_engines[engine]].buffer[index];
+        }
+
+        if (sum > 32767) sum = 32767;
+        if (sum < -32768) sum = -32768;
+        output[index] = sum;
+    }
+}
+
+static int get_block_peak(const EAS_PCM *buffer)
+{
+    unsigned int index;
+    int peak;
+
+    peak = 0;
+    for (index = 0; index < samples_per_call * num_channels; index++)
+    {
+        if (buffer[index] > peak) peak = buffer[index];
+        if (-buffer[index] > peak) peak = -buffer[index];
+    }
+
+    return peak;
 }
 
-static void usage(const char *progname)
+// returns non-zero if no sample in the block exceeds the threshold
+static int is_silent_block(const EAS_PCM *buffer, int threshold)
 {
-    static const char basename[] = "eas_alsadrv";
+    return get_block_peak(buffer) <= threshold;
+}
 
-    if (progname == NULL)
+// engine becomes idle after producing silent blocks (including effect tails) without held notes for a while
+static void update_engine_silence(synth_engine_t *engine, const EAS_PCM *buffer)
+{
+    if (engine->num_held != 0 || !is_silent_block(buffer, skip_silence))
     {
-        progname = basename;
+        engine->silent_blocks = 0;
+        return;
     }
-    else
-    {
-        const char *slash;
 
-        slash = strrchr(progname, '/');
-        if (slash != NULL)
-        {
-            progname = slash + 1;
-        }
+    engine->silent_blocks++;
+    if (engine->silent_blocks >= idle_blocks)
+    {
+        engine->idle = 1;
     }
-
-    printf(
-        "%s - Sonivox EAS\n"
-        "Usage: %s [OPTIONS]...\n"
-        "  -p NUM   Polyphony\n"
-        "  -m NUM   Master volume (0-100)\n"
-        "  -s PATH  Dls soundfont path (path to .dls file)\n"
-        "  -r NUM   Reverb preset (0=off, 1=large hall, 2=hall, 3=chamber, 4=room)\n"
-        "  -w NUM   Reverb wet (0-32767)\n"
-        "  -c NUM   Chorus preset (0=off, 1=preset 1, 2=preset 2, 3=preset 3, 4=preset 4)\n"
-        "  -a NUM   Chorus rate (10-50)\n"
-        "  -e NUM   Chorus depth (15-60)\n"
-        "  -l NUM   Chorus level (0-32767)\n"
-        "  -d       Daemonize\n"
-        "  -h       Help\n",
-        basename,
-        progname
-    );
-    exit(1);
 }
 
-static void read_arguments(int argc, char *argv[]) __attribute__((noinline));
-static void read_arguments(int argc, char *argv[])
+static int render_subbuffer(int num, uint64_t deadline)
 {
-    int i, j;
+    EAS_PCM *buffer;
+    int index, engine, result, num_active;
+    int active_engines[MAX_ENGINES];
 
-    polyphony = 0;
-    master_volume = -1;
-    daemonize = 0;
-    reverb_preset = 0;
-    reverb_wet = -1;
-    chorus_preset = 0;
-    chorus_rate = -1;
-    chorus_depth = -1;
-    chorus_level = -1;
-    dls_filepath = NULL;
+    buffer = (EAS_PCM *) &(midi_buffer[num * bytes_per_call]);
 
-    if (argc <= 1)
+    if (pcm_mmap && !resampler.active && pcm_format == SND_PCM_FORMAT_S16 && render_ahead == 0 && !batch_blocks)
     {
-        return;
+        // render directly into pcm buffer if possible (only render thread can access pcm device)
+        EAS_PCM *mmap_buffer;
+
+        mmap_buffer = begin_mmap_block();
+        if (mmap_buffer != NULL)
+        {
+            buffer = mmap_buffer;
+            mmap_pending = 1;
+        }
     }
 
-    for (i = 1; i < argc; i++)
+    num_active = 0;
+    for (index = 0; index < num_inputs; index++)
     {
-        if (argv[i][0] == '-' && argv[i][1] != 0 && argv[i][2] == 0)
+        midi_input_t *input;
+
+        input = &(inputs[index]);
+        switch (atomic_load_explicit(&(input->state), memory_order_acquire))
         {
-            switch (argv[i][1])
-            {
-                case 'p': // polyphony
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 0)
-                        {
-                            polyphony = j;
-                        }
-                    }
-                    break;
-                case 'm': // master volume
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 0 && j <= 100)
-                        {
-                            master_volume = j;
-                        }
-                    }
-                    break;
-                case 's': // dls soundfont path
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        dls_filepath = argv[i];
-                    }
-                    break;
-                case 'r': // reverb preset
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 0 && j <= 4)
-                        {
-                            reverb_preset = j;
-                        }
-                    }
-                    break;
-                case 'w': // reverb wet
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 0 && j <= 32767)
-                        {
-                            reverb_wet = j;
-                        }
-                    }
-                    break;
-                case 'c': // chorus preset
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 0 && j <= 4)
-                        {
-                            chorus_preset = j;
-                        }
-                    }
-                    break;
-                case 'a': // chorus rate
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 10 && j <= 50)
-                        {
-                            chorus_rate = j;
-                        }
-                    }
-                    break;
-                case 'e': // chorus depth
-                    if ((i + 1) < argc)
-                    {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 15 && j <= 60)
-                        {
-                            chorus_depth = j;
-                        }
-                    }
-                    break;
-                case 'l': // chorus level
-                    if ((i + 1) < argc)
+            case INPUT_ACTIVE:
+                drain_event_ring(input, deadline);
+
+                // engines shared by all ports are rendered only once
+                if (streams_per_engine == 1 || index == 0)
+                {
+                    for (engine = input->first_engine; engine < input->first_engine + engines_per_input; engine++)
                     {
-                        i++;
-                        j = atoi(argv[i]);
-                        if (j >= 0 && j <= 32767)
+                        if (!engines[engine].idle)
                         {
-                            chorus_level = j;
+                            active_engines[num_active] = engine;
+                            num_active++;
                         }
                     }
-                    break;
-                case 'd': // daemonize
-                    daemonize = 1;
-                    break;
-                case 'h': // help
-                    usage(argv[0]);
-                default:
-                    break;
-            }
-        }
-        else if (strcmp(argv[i], "--help") == 0)
-        {
-            usage(argv[0]);
-        }
-    }
-}
+                }
+                break;
 
+            case INPUT_RELEASED:
+                // remaining events of detached client are not played, pool thread resets the engines
+                discard_event_ring(input->ring);
+                atomic_store_explicit(&(input->state), INPUT_RECYCLING, memory_order_release);
+                sem_post(&pool_sem);
+                break;
 
-static int dls_read_at(void *handle, void *buf, int offset, int size)
-{
-    int dls_size;
+            default:
+                break;
+        }
+    }
 
-    dls_size = ((dls_file_handle_t *)handle)->dls_size;
-    if ((offset < 0) || (offset >= dls_size)) return 0;
-    if (size > dls_size - offset) size = dls_size - offset;
+    // render audio data
+    if (num_active == 0)
+    {
+        if (skip_silence >= 0)
+        {
+            stat_add(&stats.blocks_skipped, 1);
+        }
 
-    memcpy(buf, offset + ((dls_file_handle_t *)handle)->dls_address, size);
+        memset(buffer, 0, bytes_per_call);
+        return 0;
+    }
 
-    return size;
-}
+    if (num_active == 1)
+    {
+        result = render_engine(&(engines[active_engines[0]]), buffer);
+        if (skip_silence >= 0)
+        {
+            update_engine_silence(&(engines[active_engines[0]]), buffer);
+        }
+        return result;
+    }
 
-static int dls_get_size(void *handle)
-{
-    return ((dls_file_handle_t *)handle)->dls_size;
-}
+    // the first engine is rendered by render thread, other engines are rendered in parallel by worker threads
+    for (index = 1; index < num_active; index++)
+    {
+        sem_post(&(engines[active_engines[index]].render_start));
+    }
 
-static int load_dls_file(void)
-{
-    int dls_fd;
-    struct stat statbuf;
-    dls_file_handle_t dls_file_handle;
-    EAS_FILE eas_file;
-    EAS_RESULT res;
+    result = render_engine(&(engines[active_engines[0]]), engines[active_engines[0]].buffer);
 
-    dls_fd = open(dls_filepath, O_RDONLY);
-    if (dls_fd < 0)
+    for (index = 1; index < num_active; index++)
     {
-        char *dlspathcopy, *slash, *filename;
-        DIR *dir;
-        struct dirent *entry;
+        engine = active_engines[index];
 
-        dlspathcopy = strdup(dls_filepath);
-        if (dlspathcopy == NULL) return -1;
+        while (sem_wait(&(engines[engine].render_done)) < 0 && errno == EINTR);
 
-        slash = strrchr(dlspathcopy, '/');
-        if (slash != NULL)
-        {
-            filename = slash + 1;
-            if (slash != dlspathcopy)
-            {
-                *slash = 0;
-                dir = opendir(dlspathcopy);
-                *slash = '/';
-            }
-            else
-            {
-                dir = opendir("/");
-            }
-        }
-        else
+        if (engines[engine].render_result < 0)
         {
-            filename = dlspathcopy;
-            dir = opendir(".");
+            result = engines[engine].render_result;
         }
+    }
 
-        if (dir == NULL)
+    if (skip_silence >= 0)
+    {
+        for (index = 0; index < num_active; index++)
         {
-            free(dlspathcopy);
-            return -2;
+            update_engine_silence(&(engines[active_engines[index]]), engines[active_engines[index]].buffer);
         }
+    }
 
-        while (1)
-        {
-            entry = readdir(dir);
-            if (entry == NULL) break;
+    mix_engine_blocks(buffer, active_engines, num_active);
 
-            if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG && entry->d_type != DT_LNK) continue;
+    return result;
+}
 
-            if (0 != strcasecmp(filename, entry->d_name)) continue;
+static int output_mmap(const uint8_t *buf_ptr, snd_pcm_uframes_t remaining)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t committed;
+    unsigned int frame_size;
 
-            strcpy(filename, entry->d_name);
-            break;
-        };
+    frame_size = pcm_frame_size;
 
-        closedir(dir);
+    while (remaining)
+    {
+        frames = remaining;
+        if (snd_pcm_mmap_begin(midi_pcm, &areas, &offset, &frames) < 0)
+        {
+            return -1;
+        }
+        if (frames == 0)
+        {
+            return -2;
+        }
 
-        if (entry == NULL)
+        memcpy((uint8_t *)areas[0].addr + (areas[0].first / 8) + offset * frame_size, buf_ptr, frames * frame_size);
+
+        committed = snd_pcm_mmap_commit(midi_pcm, offset, frames);
+        if (committed < 0)
         {
-            free(dlspathcopy);
             return -3;
         }
 
-        dls_fd = open(dlspathcopy, O_RDONLY);
+        remaining -= committed;
+        buf_ptr += committed * frame_size;
+    };
 
-        free(dlspathcopy);
+    return 0;
+}
 
-        if (dls_fd < 0)
-        {
-            return -4;
-        }
-    }
+// returns number of written frames or negative value on error
+// write count consecutive subbuffers to pcm device, returns number of written frames
+static int output_subbuffers(int num, unsigned int count)
+{
+    snd_pcm_uframes_t remaining, frames;
+    snd_pcm_sframes_t written;
+    uint8_t *buf_ptr;
+    unsigned int index;
 
-    if (fstat(dls_fd, &statbuf) < 0)
+    if (mmap_pending)
     {
-        close(dls_fd);
-        return -5;
+        // block was rendered directly into pcm buffer
+        mmap_pending = 0;
+        written = snd_pcm_mmap_commit(midi_pcm, mmap_offset, samples_per_call);
+        return (written == samples_per_call) ? (int)samples_per_call : -1;
     }
 
-    dls_file_handle.dls_size = statbuf.st_size;
-    dls_file_handle.dls_address = (uint8_t *) mmap(NULL, dls_file_handle.dls_size, PROT_READ, MAP_PRIVATE, dls_fd, 0);
+    buf_ptr = &(midi_buffer[num * bytes_per_call]);
+    frames = count * samples_per_call;
 
-    close(dls_fd);
+    if (resampler.active)
+    {
+        frames = 0;
+        for (index = 0; index < count; index++)
+        {
+            frames += resample_block((const EAS_PCM *) (buf_ptr + index * bytes_per_call), pcm_output_buffer + frames * pcm_frame_size);
+        }
+        buf_ptr = pcm_output_buffer;
+    }
+    else if (pcm_format != SND_PCM_FORMAT_S16)
+    {
+        convert_samples((const EAS_PCM *) buf_ptr, pcm_output_buffer, frames * num_channels);
+        buf_ptr = pcm_output_buffer;
+    }
 
-    if (dls_file_handle.dls_address == MAP_FAILED)
+    if (pcm_mmap)
     {
-        return -6;
+        return (output_mmap(buf_ptr, frames) < 0) ? -1 : (int)frames;
     }
 
-    eas_file.handle = &dls_file_handle;
-    eas_file.readAt = dls_read_at;
-    eas_file.size = dls_get_size;
+    remaining = frames;
+    while (remaining)
+    {
+        written = snd_pcm_writei(midi_pcm, buf_ptr, remaining);
+        if (written < 0)
+        {
+            return -1;
+        }
 
-    res = EAS_LoadDLSCollection(data_handle, NULL, &eas_file);
+        remaining -= written;
+        buf_ptr += written * pcm_frame_size;
+    };
 
-    munmap(dls_file_handle.dls_address, dls_file_handle.dls_size);
+    return frames;
+}
 
-    if (res != EAS_SUCCESS)
+// playback using mmap access must be started explicitly
+static void start_mmap_playback(void)
+{
+    if (pcm_mmap && snd_pcm_state(midi_pcm) == SND_PCM_STATE_PREPARED)
     {
-        return -7;
+        snd_pcm_start(midi_pcm);
     }
-
-    return 0;
 }
 
-
-static int start_synth(void) __attribute__((noinline));
-static int start_synth(void)
+// discard audio queued in pcm buffer down to the minimal depth, so new events are heard as soon as possible
+static void discard_queued_audio(void)
 {
-    const S_EAS_LIB_CONFIG *eas_config;
-    EAS_RESULT res;
+    snd_pcm_sframes_t delay_frames, rewind_frames, keep_frames;
 
-    eas_config = EAS_Config();
+    if (snd_pcm_delay(midi_pcm, &delay_frames) < 0)
+    {
+        return;
+    }
 
-    num_channels = eas_config->numChannels;
-    frequency = eas_config->sampleRate;
-    samples_per_call = eas_config->mixBufferSize;
-    bytes_per_call = samples_per_call * num_channels * sizeof(EAS_PCM);
+    // keep the minimal depth used by adaptive margin (two blocks) queued, the render loop refills the rest of the margin
+    keep_frames = (render_margin < 2 * block_frames) ? render_margin : 2 * block_frames;
+    if (delay_frames <= keep_frames)
+    {
+        return;
+    }
 
-    num_subbuffers = (4096 * (int64_t)frequency) / (11025 * (int64_t)samples_per_call);
-    if (num_subbuffers > 65536 / bytes_per_call)
+    rewind_frames = snd_pcm_rewindable(midi_pcm);
+    if (rewind_frames > delay_frames - keep_frames)
     {
-        num_subbuffers = 65536 / bytes_per_call;
+        rewind_frames = delay_frames - keep_frames;
     }
-    if (num_subbuffers < 4)
+
+    if (rewind_frames > 0)
     {
-        fprintf(stderr, "Unsupported EAS parameters: %i, %i, %i\n", num_channels, frequency, samples_per_call);
-        return -1;
+        rewind_frames = snd_pcm_rewind(midi_pcm, rewind_frames);
     }
 
-    // initialize EAS
-    res = EAS_Init(&data_handle);
-    if (res != EAS_SUCCESS)
+    if (rewind_frames <= 0)
     {
-        fprintf(stderr, "Error initializing EAS: %i\n", (int)res);
-        return -2;
+        // rewinding is not supported, drop all queued audio
+        snd_pcm_drop(midi_pcm);
+        snd_pcm_prepare(midi_pcm);
     }
 
-    if (dls_filepath != NULL && *dls_filepath != 0)
+    if (snd_pcm_delay(midi_pcm, &delay_frames) < 0)
+    {
+        delay_frames = 0;
+    }
+
+    // the first event is played after remaining queued audio and its own block
+    delay_frames += block_frames;
+    printf("Discarded queued audio, first event latency: %u frames (%.1f ms)\n", (unsigned int)delay_frames, (delay_frames * 1000.0) / pcm_rate);
+}
+
+// discard blocks which were rendered ahead before new events arrived
+static void discard_rendered_blocks(void)
+{
+    while (sem_trywait(&render_ahead_ready) == 0)
     {
-        if (load_dls_file() < 0)
+        subbuf_counter++;
+        if (subbuf_counter == num_subbuffers)
         {
-            fprintf(stderr, "Error loading DLS file: %s\n", dls_filepath);
-            return -3;
+            subbuf_counter = 0;
         }
+
+        sem_post(&render_ahead_free);
     }
+}
 
-    // set master volume
-    if (master_volume >= 0)
+// returns number of milliseconds until the given number of seconds elapses from last_time
+static int get_idle_timeout(const struct timespec *last_time, int seconds)
+{
+    struct timespec current_time;
+    int64_t timeout;
+
+    clock_gettime(MONOTONIC_CLOCK_TYPE, &current_time);
+    timeout = (last_time->tv_sec + seconds - current_time.tv_sec) * (int64_t)1000 + (last_time->tv_nsec - current_time.tv_nsec) / 1000000;
+
+    return (timeout < 0) ? 0 : (int)timeout;
+}
+
+// fill pcm buffer with silence up to the render margin and start playback
+static void prefill_pcm_buffer(void)
+{
+    unsigned int index;
+
+    snd_pcm_avail_update(midi_pcm);
+    for (index = 0; index < render_margin / block_frames; index++)
     {
-        EAS_SetVolume(data_handle, NULL, master_volume);
+        output_subbuffers(index % num_subbuffers, 1);
     }
+    start_mmap_playback();
+}
 
-    // set polyphony
-    if ((polyphony > 0) && (polyphony <= eas_config->maxVoices))
+static void main_loop(void) __attribute__((noinline));
+static void main_loop(void)
+{
+    int is_paused, is_closed, reopen_failed, num_pcm_fds;
+    struct timespec last_written_time, current_time;
+    struct pollfd *poll_fds;
+    uint64_t margin_change_time;
+
+    num_pcm_fds = snd_pcm_poll_descriptors_count(midi_pcm);
+    if (num_pcm_fds < 0)
     {
-        EAS_SetSynthPolyphony(data_handle, EAS_MCU_SYNTH, polyphony);
+        num_pcm_fds = 0;
     }
 
-    // set reverb
-    if (reverb_preset == 0)
+    poll_fds = (struct pollfd *) malloc((1 + num_pcm_fds) * sizeof(struct pollfd));
+    if (poll_fds == NULL)
     {
-        EAS_SetParameter(data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_BYPASS, EAS_TRUE);
+        fprintf(stderr, "Error allocating poll descriptors\n");
+        return;
     }
-    else
+
+    poll_fds[0].fd = event_fd;
+    poll_fds[0].events = POLLIN;
+
+    margin_change_time = get_time_ns();
+
+    prefill_pcm_buffer();
+
+    // let render-ahead worker fill the ring
+    for (int i = 0; i < render_ahead; i++)
     {
-        EAS_SetParameter(data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_BYPASS, EAS_FALSE);
-        EAS_SetParameter(data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_PRESET, reverb_preset - 1);
-        if (reverb_wet >= 0)
-        {
-            EAS_SetParameter(data_handle, EAS_MODULE_REVERB, EAS_PARAM_REVERB_WET, reverb_wet);
-        }
+        sem_post(&render_ahead_free);
     }
 
-    // set chorus
-    if (chorus_preset == 0)
+    is_paused = 0;
+    is_closed = 0;
+    reopen_failed = 0;
+    // pause pcm playback at the beginning
+    if (0 == snd_pcm_pause(midi_pcm, 1))
     {
-        EAS_SetParameter(data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_BYPASS, EAS_TRUE);
+        is_paused = 1;
+        printf("PCM playback paused\n");
     }
     else
     {
-        EAS_SetParameter(data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_BYPASS, EAS_FALSE);
-        EAS_SetParameter(data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_PRESET, chorus_preset - 1);
-        if (chorus_rate >= 0)
+        // if pausing doesn't work then set time of last written event as current time, so the next attempt to pause will be in 60 seconds
+        clock_gettime(MONOTONIC_CLOCK_TYPE, &last_written_time);
+    }
+
+    while (midi_init_state > 0)
+    {
+        snd_pcm_state_t pcmstate;
+        snd_pcm_sframes_t available_frames, delay_frames;
+        int written_frames;
+        uint64_t render_time;
+        int num_fds, timeout;
+        eventfd_t event_count;
+
+        if (is_closed)
         {
-            EAS_SetParameter(data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_RATE, chorus_rate);
+            // wait only for midi events, retry reopening pcm device after a failure
+            num_fds = 1;
+            timeout = reopen_failed ? 1000 : -1;
         }
-        if (chorus_depth >= 0)
+        else if (is_paused)
         {
-            EAS_SetParameter(data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_DEPTH, chorus_depth);
+            // wait only for midi events or until pcm device should be closed
+            num_fds = 1;
+            timeout = (close_timeout > 0) ? get_idle_timeout(&last_written_time, close_timeout) : -1;
         }
-        if (chorus_level >= 0)
+        else
         {
-            EAS_SetParameter(data_handle, EAS_MODULE_CHORUS, EAS_PARAM_CHORUS_LEVEL, chorus_level);
+            // wait for midi events or until pcm device can accept more data
+            num_fds = 1 + snd_pcm_poll_descriptors(midi_pcm, &(poll_fds[1]), num_pcm_fds);
+
+            // wake up in time to pause pcm playback after 60 seconds without events
+            clock_gettime(MONOTONIC_CLOCK_TYPE, &current_time);
+            timeout = (last_written_time.tv_sec + 61 - current_time.tv_sec) * 1000 - current_time.tv_nsec / 1000000;
+            if (timeout < 0)
+            {
+                timeout = 0;
+            }
+
+            if (close_timeout > 0 && get_idle_timeout(&last_written_time, close_timeout) < timeout)
+            {
+                timeout = get_idle_timeout(&last_written_time, close_timeout);
+            }
         }
-    }
 
-    // open midi stream
-    res = EAS_OpenMIDIStream(data_handle, &stream_handle, NULL);
-    if (res != EAS_SUCCESS)
-    {
-        fprintf(stderr, "Error opening EAS midi stream: %i\n", (int)res);
-        EAS_Shutdown(data_handle);
-        return -4;
-    }
+        if (poll(poll_fds, num_fds, timeout) < 0)
+        {
+            if (errno != EINTR)
+            {
+                fprintf(stderr, "Error polling: %i\n", errno);
+            }
+            continue;
+        }
 
-    // prepare variables
-    event_read_index = 0;
-    event_write_index = 0;
-    subbuf_counter = 0;
-    memset(midi_buffer, 0, 65536);
+        if (poll_fds[0].revents & POLLIN)
+        {
+            eventfd_read(event_fd, &event_count);
+        }
 
+        if (num_fds > 1)
+        {
+            unsigned short revents;
 
-    return 0;
-}
+            // let the pcm plugin process its poll descriptors
+            snd_pcm_poll_descriptors_revents(midi_pcm, &(poll_fds[1]), num_fds - 1, &revents);
+        }
 
-static void stop_synth(void)
-{
-    // close midi stream
-    EAS_CloseMIDIStream(data_handle, stream_handle);
+        if (is_closed && reopen_failed)
+        {
+            // events which arrived while pcm device couldn't be reopened are still waiting
+            atomic_store(&midi_event_written, 1);
+        }
 
-    // shutdown EAS
-    EAS_Shutdown(data_handle);
-}
+        if (atomic_exchange(&midi_event_written, 0))
+        {
+            // remember time of last written event
+            clock_gettime(MONOTONIC_CLOCK_TYPE, &last_written_time);
 
-static int run_as_daemon(void) __attribute__((noinline));
-static int run_as_daemon(void)
-{
-    int err;
+            if (is_closed)
+            {
+                if (reopen_pcm_output() < 0)
+                {
+                    reopen_failed = 1;
+                    continue;
+                }
 
-    printf("Running as daemon...\n");
+                is_closed = 0;
+                reopen_failed = 0;
 
-    err = daemon(0, 0);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error running as daemon: %i\n", err);
-        return -1;
-    }
+                num_pcm_fds = snd_pcm_poll_descriptors_count(midi_pcm);
+                if (num_pcm_fds < 0)
+                {
+                    num_pcm_fds = 0;
+                }
 
-    return 0;
-}
+                free(poll_fds);
+                poll_fds = (struct pollfd *) malloc((1 + num_pcm_fds) * sizeof(struct pollfd));
+                if (poll_fds == NULL)
+                {
+                    fprintf(stderr, "Error allocating poll descriptors\n");
+                    return;
+                }
 
-static int open_midi_port(void) __attribute__((noinline));
-static int open_midi_port(void)
-{
-    int err;
-    unsigned int caps, type;
+                poll_fds[0].fd = event_fd;
+                poll_fds[0].events = POLLIN;
 
-    err = snd_seq_open(&midi_seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error opening ALSA sequencer: %i\n%s\n", err, snd_strerror(err));
-        return -1;
-    }
+                printf("PCM device reopened\n");
 
-    err = snd_seq_set_client_name(midi_seq, midi_name);
-    if (err < 0)
-    {
-        snd_seq_close(midi_seq);
-        fprintf(stderr, "Error setting sequencer client name: %i\n%s\n", err, snd_strerror(err));
-        return -2;
-    }
+                // the first block is rendered with the new events
+                snd_pcm_avail_update(midi_pcm);
+                if (render_ahead > 0)
+                {
+                    discard_rendered_blocks();
+                }
+            }
+            else if (is_paused)
+            {
+                is_paused = 0;
+                snd_pcm_pause(midi_pcm, 0);
+                printf("PCM playback unpaused\n");
 
-    caps = SND_SEQ_PORT_CAP_SUBS_WRITE | SND_SEQ_PORT_CAP_WRITE;
-    type = SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_MIDI_GM | SND_SEQ_PORT_TYPE_SYNTHESIZER;
-    err = snd_seq_create_simple_port(midi_seq, port_name, caps, type);
-    if (err < 0)
-    {
-        snd_seq_close(midi_seq);
-        fprintf(stderr, "Error creating sequencer port: %i\n%s\n", err, snd_strerror(err));
-        return -3;
-    }
-    midi_port_id = err;
+                // audio rendered before pausing would be played in front of the new events
+                discard_queued_audio();
+                if (render_ahead > 0)
+                {
+                    discard_rendered_blocks();
+                }
+            }
+        }
+        else
+        {
+            if (is_closed)
+            {
+                continue;
+            }
 
-    printf("%s ALSA address is %i:0\n", midi_name, snd_seq_client_id(midi_seq));
+            if (close_timeout > 0 && get_idle_timeout(&last_written_time, close_timeout) == 0)
+            {
+                // release pcm device, so it can be used by other applications or powered down
+                snd_pcm_drop(midi_pcm);
+                snd_pcm_close(midi_pcm);
+                midi_pcm = NULL;
+                mmap_pending = 0;
+                is_closed = 1;
+                is_paused = 0;
+                printf("PCM device closed\n");
+                continue;
+            }
 
-    return 0;
-}
+            if (is_paused)
+            {
+                continue;
+            }
+
+            clock_gettime(MONOTONIC_CLOCK_TYPE, &current_time);
+            // if more than 60 seconds elapsed from last written event, then pause pcm playback
+            if (current_time.tv_sec - last_written_time.tv_sec > 60)
+            {
+                if (0 == snd_pcm_pause(midi_pcm, 1))
+                {
+                    is_paused = 1;
+                    printf("PCM playback paused\n");
+                    continue;
+                }
+                else
+                {
+                    // if pausing doesn't work then set time of last written event as current time, so the next attempt to pause will be in 60 seconds
+                    last_written_time = current_time;
+                }
+            }
+        }
+
+        pcmstate = snd_pcm_state(midi_pcm);
+        if (pcmstate == SND_PCM_STATE_DISCONNECTED)
+        {
+            // device was unplugged or its driver was unloaded, try opening the device list every second
+            fprintf(stderr, "PCM device %s lost\n", pcm_devices[pcm_device_index]);
+            snd_pcm_close(midi_pcm);
+            midi_pcm = NULL;
+            mmap_pending = 0;
+            is_closed = 1;
+            is_paused = 0;
+            reopen_failed = 1;
+            continue;
+        }
+        else if (pcmstate == SND_PCM_STATE_XRUN)
+        {
+            fprintf(stderr, "Buffer underrun\n");
+            stat_add(&stats.xruns, 1);
+            snd_pcm_prepare(midi_pcm);
 
-static void close_midi_port(void)
-{
-    snd_seq_delete_port(midi_seq, midi_port_id);
-    snd_seq_close(midi_seq);
-}
+            if (adaptive_margin && render_margin < pcm_buffer_size - block_frames)
+            {
+                // render further ahead after buffer underrun
+                set_render_margin(render_margin + block_frames);
+                set_sw_params();
+                margin_change_time = get_time_ns();
+                printf("Render margin raised to %u frames (%.1f ms)\n", render_margin, (render_margin * 1000.0) / pcm_rate);
+            }
+        }
+        else if (adaptive_margin && render_margin > 2 * block_frames)
+        {
+            // slowly lower the margin when there were no buffer underruns for some time
+            if (get_time_ns() - margin_change_time >= adaptive_decay * (uint64_t)1000000000)
+            {
+                set_render_margin(render_margin - block_frames);
+                set_sw_params();
+                margin_change_time = get_time_ns();
+                printf("Render margin lowered to %u frames (%.1f ms)\n", render_margin, (render_margin * 1000.0) / pcm_rate);
+            }
+        }
 
+        available_frames = snd_pcm_avail_update(midi_pcm);
 
-static int set_hw_params(void)
-{
-    int err, dir;
-    unsigned int rate;
-    snd_pcm_uframes_t buffer_size, period_size;
-    snd_pcm_hw_params_t *pcm_hwparams;
+        delay_frames = -1;
+        render_time = 0;
+        if (event_timing && render_ahead == 0 && available_frames >= render_threshold)
+        {
+            // find out when the next rendered block will be played
+            if (snd_pcm_delay(midi_pcm, &delay_frames) < 0)
+            {
+                delay_frames = -1;
+            }
+            render_time = get_time_ns();
+        }
 
-    snd_pcm_hw_params_alloca(&pcm_hwparams);
+        while (available_frames >= render_threshold)
+        {
+            unsigned int num_blocks, block;
 
-    err = snd_pcm_hw_params_any(midi_pcm, pcm_hwparams);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error getting hwparams: %i\n%s\n", err, snd_strerror(err));
-        return -1;
-    }
+            num_blocks = 1;
+            if (batch_blocks)
+            {
+                // render all blocks which fit into pcm buffer and into consecutive subbuffers, then write them at once
+                num_blocks = (available_frames - render_threshold) / block_frames + 1;
+                if (num_blocks > num_subbuffers - subbuf_counter)
+                {
+                    num_blocks = num_subbuffers - subbuf_counter;
+                }
+                // render-ahead ring can't provide more blocks before they are written
+                if (render_ahead > 0 && num_blocks > (unsigned int)render_ahead)
+                {
+                    num_blocks = render_ahead;
+                }
+            }
 
-    err = snd_pcm_hw_params_set_access(midi_pcm, pcm_hwparams, SND_PCM_ACCESS_RW_INTERLEAVED);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting access: %i\n%s\n", err, snd_strerror(err));
-        return -2;
-    }
+            for (block = 0; block < num_blocks; block++)
+            {
+                if (render_ahead > 0)
+                {
+                    // take the next block from the ring, wait for it if render-ahead worker fell behind
+                    if (sem_trywait(&render_ahead_ready) < 0)
+                    {
+                        stat_add(&stats.render_ahead_empty, 1);
+                        while (sem_wait(&render_ahead_ready) < 0 && errno == EINTR);
+                    }
+                }
+                else if (render_subbuffer(subbuf_counter + block, get_block_deadline(render_time, (delay_frames < 0) ? delay_frames : delay_frames + block * block_frames)) < 0)
+                {
+                    fprintf(stderr, "Error rendering audio data\n");
+                }
+            }
 
-    err = snd_pcm_hw_params_set_format(midi_pcm, pcm_hwparams, SND_PCM_FORMAT_S16);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting format: %i\n%s\n", err, snd_strerror(err));
-        return -3;
-    }
+            written_frames = output_subbuffers(subbuf_counter, num_blocks);
 
-    err = snd_pcm_hw_params_set_channels(midi_pcm, pcm_hwparams, num_channels);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting channels: %i\n%s\n", err, snd_strerror(err));
-        return -4;
-    }
+            if (render_ahead > 0)
+            {
+                // the subbuffers can be rendered again
+                for (block = 0; block < num_blocks; block++)
+                {
+                    sem_post(&render_ahead_free);
+                }
+            }
 
-    rate = frequency;
-    dir = 0;
-    err = snd_pcm_hw_params_set_rate_near(midi_pcm, pcm_hwparams, &rate, &dir);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting rate: %i\n%s\n", err, snd_strerror(err));
-        return -5;
-    }
+            if (batch_blocks)
+            {
+                stat_add(&stats.batches, 1);
+                stat_add(&stats.batched_blocks, num_blocks);
+            }
 
-    buffer_size = samples_per_call * num_subbuffers;
-    err = snd_pcm_hw_params_set_buffer_size_near(midi_pcm, pcm_hwparams, &buffer_size);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting buffer size: %i\n%s\n", err, snd_strerror(err));
-        return -6;
-    }
+            if (written_frames < 0)
+            {
+                fprintf(stderr, "Error writing audio data\n");
+                available_frames = 0;
+                if (render_ahead > 0)
+                {
+                    subbuf_counter += num_blocks;
+                    if (subbuf_counter == num_subbuffers)
+                    {
+                        subbuf_counter = 0;
+                    }
+                }
+                break;
+            }
+            else
+            {
+                available_frames -= written_frames;
+                if (delay_frames >= 0)
+                {
+                    delay_frames += written_frames;
+                }
+            }
 
-    period_size = samples_per_call;
-    dir = 0;
-    err = snd_pcm_hw_params_set_period_size_near(midi_pcm, pcm_hwparams, &period_size, &dir);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting period size: %i\n%s\n", err, snd_strerror(err));
-        return -7;
-    }
+            subbuf_counter += num_blocks;
+            if (subbuf_counter == num_subbuffers)
+            {
+                subbuf_counter = 0;
+            }
+        };
 
-    err = snd_pcm_hw_params(midi_pcm, pcm_hwparams);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting hwparams: %i\n%s\n", err, snd_strerror(err));
-        return -8;
-    }
+        start_mmap_playback();
+    };
 
-    return 0;
+    free(poll_fds);
 }
 
-static int set_sw_params(void)
+static void *render_thread_proc(void *arg)
 {
-    snd_pcm_sw_params_t *swparams;
-    int err;
+    // try setting thread scheduler (only root)
+    set_thread_scheduler(&render_sched, "render");
 
-    snd_pcm_sw_params_alloca(&swparams);
+    // set thread as initialized
+    ((thread_start_t *)arg)->initialized = 1;
 
-    err = snd_pcm_sw_params_current(midi_pcm, swparams);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error getting swparams: %i\n%s\n", err, snd_strerror(err));
-        return -1;
-    }
+    wait_for_midi_initialization();
 
-    err = snd_pcm_sw_params_set_avail_min(midi_pcm, swparams, samples_per_call);
-    if (err < 0)
+    if (midi_init_state > 0)
     {
-        fprintf(stderr, "Error setting avail min: %i\n%s\n", err, snd_strerror(err));
-        return -2;
-    }
+        if (probe_filepath != NULL)
+        {
+            // latency is probed with scheduler of render thread
+            probe_result = probe_latency();
+        }
+        else
+        {
+            main_loop();
+        }
 
-    err = snd_pcm_sw_params(midi_pcm, swparams);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error setting sw params: %i\n%s\n", err, snd_strerror(err));
-        return -3;
+        if (midi_init_state > 0)
+        {
+            // render loop failed (or probe finished) - stop the other threads and wake up main thread
+            if (probe_filepath == NULL)
+            {
+                fprintf(stderr, "Render loop stopped\n");
+            }
+            midi_init_state = -1;
+            kill(getpid(), SIGUSR2);
+        }
     }
 
-    return 0;
+    return NULL;
 }
 
-static int open_pcm_output(void) __attribute__((noinline));
-static int open_pcm_output(void)
+static void *render_ahead_thread_proc(void *arg)
 {
-    int err;
+    unsigned int num;
 
-    err = snd_pcm_open(&midi_pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
-    if (err < 0)
-    {
-        fprintf(stderr, "Error opening PCM device: %i\n%s\n", err, snd_strerror(err));
-        return -1;
-    }
+    // try setting thread scheduler (only root)
+    set_thread_scheduler(&render_sched, "render-ahead");
 
-    if (set_hw_params() < 0)
-    {
-        return -2;
-    }
+    // set thread as initialized
+    ((thread_start_t *)arg)->initialized = 1;
 
-    if (set_sw_params() < 0)
+    wait_for_midi_initialization();
+
+    // keep the ring of rendered blocks filled, render thread only writes finished blocks to pcm device
+    num = 0;
+    while (midi_init_state > 0)
     {
-        return -3;
-    }
+        if (sem_wait(&render_ahead_free) < 0)
+        {
+            continue;
+        }
 
-    // set nonblock mode
-    snd_pcm_nonblock(midi_pcm, 1);
+        if (render_subbuffer(num, UINT64_MAX) < 0)
+        {
+            fprintf(stderr, "Error rendering audio data\n");
+        }
 
-    snd_pcm_prepare(midi_pcm);
+        sem_post(&render_ahead_ready);
 
-    return 0;
-}
+        num++;
+        if (num == num_subbuffers)
+        {
+            num = 0;
+        }
+    };
 
-static void close_pcm_output(void)
-{
-    snd_pcm_close(midi_pcm);
+    return NULL;
 }
 
-
-static int drop_privileges(void)
+static void *worker_thread_proc(void *arg)
 {
-    uid_t uid;
-    gid_t gid;
-    const char *sudo_id;
-    long long int llid;
-    const char *xdg_dir;
-    char buf[32];
-    struct stat statbuf;
-    struct passwd *passwdbuf;
+    synth_engine_t *engine;
+    thread_sched_t sched;
 
-    if (getuid() != 0)
-    {
-        return 0;
-    }
+    engine = (synth_engine_t *) ((thread_start_t *)arg)->arg;
 
-    sudo_id = secure_getenv("SUDO_UID");
-    if (sudo_id == NULL)
+    // workers use the same scheduler as the render thread, each one can be pinned to a different CPU
+    sched = render_sched;
+    if (use_worker_cpus)
     {
-        sudo_id = secure_getenv("PKEXEC_UID");
-        if (sudo_id == NULL)
+        int cpu, num;
+
+        num = (engine - engines - 1) % CPU_COUNT(&worker_cpus);
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
         {
-            return -1;
+            if (CPU_ISSET(cpu, &worker_cpus) && num-- == 0)
+            {
+                break;
+            }
         }
-    }
 
-    errno = 0;
-    llid = strtoll(sudo_id, NULL, 10);
-    uid = (uid_t) llid;
-    if (errno != 0 || uid == 0 || llid != (long long int)uid)
-    {
-        return -2;
+        CPU_ZERO(&(sched.affinity));
+        CPU_SET(cpu, &(sched.affinity));
+        sched.use_affinity = 1;
     }
 
-    gid = getgid();
-    if (gid == 0)
-    {
-        sudo_id = secure_getenv("SUDO_GID");
-        if (sudo_id == NULL)
-        {
-            passwdbuf = getpwuid(uid);
-            if (passwdbuf != NULL)
-            {
-                gid = passwdbuf->pw_gid;
-            }
+    // try setting thread scheduler (only root)
+    set_thread_scheduler(&sched, "worker");
 
-            if (gid == 0)
-            {
-                return -3;
-            }
-        }
-        else
+    // set thread as initialized
+    ((thread_start_t *)arg)->initialized = 1;
+
+    while (1)
+    {
+        if (sem_wait(&(engine->render_start)) < 0)
         {
-            errno = 0;
-            llid = strtoll(sudo_id, NULL, 10);
-            gid = (gid_t) llid;
-            if (errno != 0 || gid == 0 || llid != (long long int)gid)
-            {
-                return -4;
-            }
+            continue;
         }
-    }
 
-    if (setgid(gid) != 0)
-    {
-        return -5;
-    }
-    if (setuid(uid) != 0)
-    {
-        return -6;
-    }
+        engine->render_result = render_engine(engine, engine->buffer);
 
-    printf("Dropped root privileges\n");
+        sem_post(&(engine->render_done));
+    };
+
+    return NULL;
+}
 
-    chdir("/");
 
-    // define some environment variables
+// stop all sounds and reset controllers of released synth instance
+static void reset_input(midi_input_t *input, EAS_PCM *buffer)
+{
+    uint8_t gm_system_on[6] = { 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 };
+    uint8_t data[3];
+    int engine, channel, block;
 
-    xdg_dir = getenv("XDG_RUNTIME_DIR");
-    if ((xdg_dir == NULL) || (*xdg_dir == 0))
+    for (engine = input->first_engine; engine < input->first_engine + engines_per_input; engine++)
     {
-        snprintf(buf, 32, "/run/user/%lli", (long long int)uid);
+        synth_engine_t *synth;
 
-        if ((stat(buf, &statbuf) == 0) && ((statbuf.st_mode & S_IFMT) == S_IFDIR) && (statbuf.st_uid == uid))
+        synth = &(engines[engine]);
+        for (channel = 0; channel < 16; channel++)
         {
-            // if XDG_RUNTIME_DIR is not defined and directory /run/user/$USER exists then use it for XDG_RUNTIME_DIR
-            setenv("XDG_RUNTIME_DIR", buf, 1);
+            // all sound off, reset all controllers
+            data[0] = 0xB0 | channel;
+            data[1] = 120;
+            data[2] = 0;
+            EAS_WriteMIDIStream(synth->data_handle, synth->stream_handle[input->stream], data, 3);
+            data[1] = 121;
+            EAS_WriteMIDIStream(synth->data_handle, synth->stream_handle[input->stream], data, 3);
+        }
+        EAS_WriteMIDIStream(synth->data_handle, synth->stream_handle[input->stream], gm_system_on, 6);
 
-            xdg_dir = getenv("XDG_CONFIG_HOME");
-            if ((xdg_dir == NULL) || (*xdg_dir == 0))
+        synth->emitted_status[input->stream] = 0;
+        synth->active_notes = 0;
+        memset(synth->held_notes, 0, sizeof(synth->held_notes));
+        memset(synth->sustain, 0, sizeof(synth->sustain));
+        synth->num_held = 0;
+
+        // let the reverb and chorus tails decay (at most 5 seconds)
+        for (block = 0; block < (int)((5 * frequency) / samples_per_call); block++)
+        {
+            if (render_engine(synth, buffer) < 0 || is_silent_block(buffer, 0))
             {
-                passwdbuf = getpwuid(uid);
-                if (passwdbuf != NULL)
-                {
-                    // also if XDG_CONFIG_HOME is not defined then define it as user's home directory
-                    setenv("XDG_CONFIG_HOME", passwdbuf->pw_dir, 1);
-                }
+                break;
             }
         }
     }
 
-    return 0;
+    input->ring->read_status = 0;
+    memset(input->note_engine, 0xff, sizeof(input->note_engine));
+    memset(input->note_sustained, 0, sizeof(input->note_sustained));
+    memset(input->channel_sustain, 0, sizeof(input->channel_sustain));
 }
 
-static int start_thread(void) __attribute__((noinline));
-static int start_thread(void)
+static void return_to_pool(int index)
 {
-    pthread_attr_t attr;
-    int err;
-    volatile int initialized;
-
-    // try to increase priority (only root)
-    nice(-20);
+    pthread_mutex_lock(&pool_mutex);
+    free_inputs[num_free_inputs] = index;
+    num_free_inputs++;
+    atomic_store_explicit(&(inputs[index].state), INPUT_FREE, memory_order_release);
+    pthread_mutex_unlock(&pool_mutex);
+}
 
-    err = pthread_attr_init(&attr);
-    if (err != 0)
-    {
-        fprintf(stderr, "Error creating thread attribute: %i\n", err);
-        return -1;
-    }
+// resets released synth instances and keeps enough initialized instances in the pool, so they can be used without delay
+static void *pool_thread_proc(void *arg)
+{
+    EAS_PCM *buffer;
 
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    buffer = (EAS_PCM *) malloc(bytes_per_call);
 
-    midi_init_state = 0;
-    initialized = 0;
-    err = pthread_create(&midi_thread, &attr, &midi_thread_proc, (void *)&initialized);
-    pthread_attr_destroy(&attr);
+    // set thread as initialized
+    ((thread_start_t *)arg)->initialized = 1;
 
-    if (err != 0)
+    if (buffer == NULL)
     {
-        fprintf(stderr, "Error creating thread: %i\n", err);
-        return -2;
+        fprintf(stderr, "Error allocating pool thread buffer, released synth instances won't be reused\n");
+        return NULL;
     }
 
-    // wait for thread initialization
-    while (initialized == 0)
+    while (midi_init_state >= 0)
     {
-        struct timespec req;
+        int index, num_free;
 
-        req.tv_sec = 0;
-        req.tv_nsec = 10000000;
-        nanosleep(&req, NULL);
+        if (sem_wait(&pool_sem) < 0)
+        {
+            continue;
+        }
+
+        for (index = 0; index < num_inputs; index++)
+        {
+            if (atomic_load_explicit(&(inputs[index].state), memory_order_acquire) == INPUT_RECYCLING)
+            {
+                reset_input(&(inputs[index]), buffer);
+                return_to_pool(index);
+                printf("Synth instance %i returned to pool\n", index);
+            }
+        }
+
+        pthread_mutex_lock(&pool_mutex);
+        num_free = num_free_inputs;
+        pthread_mutex_unlock(&pool_mutex);
+
+        for (index = 0; index < num_inputs && num_free < pool_size; index++)
+        {
+            if (atomic_load_explicit(&(inputs[index].state), memory_order_relaxed) == INPUT_UNUSED)
+            {
+                if (init_input_engines(&(inputs[index])) < 0)
+                {
+                    break;
+                }
+
+                return_to_pool(index);
+                num_free++;
+            }
+        }
     };
 
-    if (drop_privileges() < 0)
-    {
-        fprintf(stderr, "Error dropping root privileges\n");
-    }
+    free(buffer);
 
-    return 0;
+    return NULL;
 }
 
-
-static int render_subbuffer(int num)
+static void wait_for_signals(void) __attribute__((noinline));
+static void wait_for_signals(void)
 {
-    int read_index, write_index;
-    EAS_RESULT res;
-    EAS_I32 num_generated;
+    struct pollfd signal_poll_fd;
+    struct signalfd_siginfo siginfo;
 
-    // read global volatile variables to local variables
-    read_index = event_read_index;
-    write_index = event_write_index;
+    signal_poll_fd.fd = signal_fd;
+    signal_poll_fd.events = POLLIN;
 
-    if (read_index != write_index)
+    while (midi_init_state > 0)
     {
-        // read events from buffer
-        if (read_index < write_index)
-        {
-            EAS_WriteMIDIStream(data_handle, stream_handle, &(event_buffer[read_index]), write_index - read_index);
-        }
-        else
+        if (poll(&signal_poll_fd, 1, -1) <= 0)
         {
-            EAS_WriteMIDIStream(data_handle, stream_handle, &(event_buffer[read_index]), 65536 - read_index);
-            EAS_WriteMIDIStream(data_handle, stream_handle, &(event_buffer[0]), write_index);
+            continue;
         }
 
-        // update global volatile variable
-        event_read_index = write_index;
-    }
-
-    // render audio data
-    res = EAS_Render(data_handle, (EAS_PCM *) &(midi_buffer[num * bytes_per_call]), samples_per_call, &num_generated);
-    if (res != EAS_SUCCESS) return -1;
-    if (num_generated != samples_per_call) return -2;
-
-    return 0;
+        while (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo))
+        {
+            if (siginfo.ssi_signo == SIGUSR1)
+            {
+                print_statistics();
+            }
+        };
+    };
 }
 
-static int output_subbuffer(int num)
+static void load_latency_file(void) __attribute__((noinline));
+static void load_latency_file(void)
 {
-    snd_pcm_uframes_t remaining;
-    snd_pcm_sframes_t written;
-    uint8_t *buf_ptr;
+    FILE *f;
+    char line[256];
+    int value;
 
-    remaining = samples_per_call;
-    buf_ptr = &(midi_buffer[num * bytes_per_call]);
+    f = fopen(latency_filepath, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error opening latency file: %s\n", latency_filepath);
+        return;
+    }
 
-    while (remaining)
+    while (fgets(line, sizeof(line), f) != NULL)
     {
-        written = snd_pcm_writei(midi_pcm, buf_ptr, remaining);
-        if (written < 0)
+        if (line[0] == '#')
         {
-            return -1;
+            continue;
         }
 
-        remaining -= written;
-        buf_ptr += written << 2;
-    };
+        if (sscanf(line, "periods=%i", &value) == 1 && value >= 3)
+        {
+            latency_periods = value;
+            printf("Loaded pcm buffer size from %s: %i periods\n", latency_filepath, value);
+        }
+    }
 
-    return 0;
+    fclose(f);
 }
 
-static void main_loop(void) __attribute__((noinline));
-static void main_loop(void)
+static unsigned int get_stress_note(unsigned int block, unsigned int channel)
 {
-    int is_paused;
-    struct timespec last_written_time, current_time;
-#if defined(CLOCK_MONOTONIC_RAW)
-    clockid_t monotonic_clock_id;
+    return 36 + (block * 7 + channel * 5) % 60;
+}
 
-    #define MONOTONIC_CLOCK_TYPE monotonic_clock_id
+// stress pattern: new note on each channel in every block, notes are released 8 blocks later
+static void write_stress_events(midi_input_t *input, unsigned int block)
+{
+    uint8_t event[3];
+    unsigned int channel;
 
-    if (clock_gettime(CLOCK_MONOTONIC_RAW, &current_time))
-    {
-        monotonic_clock_id = CLOCK_MONOTONIC;
-    }
-    else
+    for (channel = 0; channel < 16; channel++)
     {
-        monotonic_clock_id = CLOCK_MONOTONIC_RAW;
-    }
-#else
-    #define MONOTONIC_CLOCK_TYPE CLOCK_MONOTONIC
-#endif
+        if (block >= 8)
+        {
+            event[0] = 0x80 | channel;
+            event[1] = get_stress_note(block - 8, channel);
+            event[2] = 0;
+            write_event(input, event, 3);
+        }
 
-    for (int i = 2; i < num_subbuffers; i++)
-    {
-        output_subbuffer(i);
+        event[0] = 0x90 | channel;
+        event[1] = get_stress_note(block, channel);
+        event[2] = 100;
+        write_event(input, event, 3);
     }
 
-    is_paused = 0;
-    // pause pcm playback at the beginning
-    if (0 == snd_pcm_pause(midi_pcm, 1))
-    {
-        is_paused = 1;
-        printf("PCM playback paused\n");
-    }
-    else
-    {
-        // if pausing doesn't work then set time of last written event as current time, so the next attempt to pause will be in 60 seconds
-        clock_gettime(MONOTONIC_CLOCK_TYPE, &last_written_time);
-    }
+    event_ring_publish(input->ring);
+}
 
-    midi_event_written = 0;
-    midi_init_state = 1;
+static void stop_stress_events(midi_input_t *input)
+{
+    uint8_t event[3];
+    unsigned int channel;
 
-    while (1)
+    for (channel = 0; channel < 16; channel++)
     {
-        struct timespec req;
-        snd_pcm_state_t pcmstate;
-        snd_pcm_sframes_t available_frames;
-
-        req.tv_sec = 0;
-        req.tv_nsec = 10000000;
-        nanosleep(&req, NULL);
+        // all sound off
+        event[0] = 0xB0 | channel;
+        event[1] = 120;
+        event[2] = 0;
+        write_event(input, event, 3);
+    }
 
-        if (midi_event_written)
-        {
-            midi_event_written = 0;
+    event_ring_publish(input->ring);
+}
 
-            // remember time of last written event
-            clock_gettime(MONOTONIC_CLOCK_TYPE, &last_written_time);
+// render stress pattern with current pcm configuration, counts buffer underruns and blocks rendered slower than real time
+static void run_probe_step(midi_input_t *input, unsigned int *xruns, unsigned int *deadline_misses)
+{
+    uint64_t start_time, render_start, block_duration;
+    snd_pcm_sframes_t available_frames;
+    unsigned int block;
+    int written_frames;
+
+    *xruns = 0;
+    *deadline_misses = 0;
+    block_duration = (samples_per_call * (uint64_t)1000000000) / frequency;
+    subbuf_counter = 0;
 
-            if (is_paused)
-            {
-                is_paused = 0;
-                snd_pcm_pause(midi_pcm, 0);
-                printf("PCM playback unpaused\n");
-            }
-        }
-        else
-        {
-            if (is_paused)
-            {
-                continue;
-            }
+    prefill_pcm_buffer();
 
-            clock_gettime(MONOTONIC_CLOCK_TYPE, &current_time);
-            // if more than 60 seconds elapsed from last written event, then pause pcm playback
-            if (current_time.tv_sec - last_written_time.tv_sec > 60)
-            {
-                if (0 == snd_pcm_pause(midi_pcm, 1))
-                {
-                    is_paused = 1;
-                    printf("PCM playback paused\n");
-                    continue;
-                }
-                else
-                {
-                    // if pausing doesn't work then set time of last written event as current time, so the next attempt to pause will be in 60 seconds
-                    last_written_time = current_time;
-                }
-            }
-        }
+    block = 0;
+    start_time = get_time_ns();
+    while (get_time_ns() - start_time < PROBE_SECONDS * (uint64_t)1000000000)
+    {
+        snd_pcm_wait(midi_pcm, 100);
 
-        pcmstate = snd_pcm_state(midi_pcm);
-        if (pcmstate == SND_PCM_STATE_XRUN)
+        if (snd_pcm_state(midi_pcm) == SND_PCM_STATE_XRUN)
         {
-            fprintf(stderr, "Buffer underrun\n");
+            (*xruns)++;
             snd_pcm_prepare(midi_pcm);
         }
 
         available_frames = snd_pcm_avail_update(midi_pcm);
-        while (available_frames >= (3 * samples_per_call))
+
+        while (available_frames >= render_threshold)
         {
-            if (render_subbuffer(subbuf_counter) < 0)
+            write_stress_events(input, block);
+            block++;
+
+            render_start = get_time_ns();
+            if (render_subbuffer(subbuf_counter, UINT64_MAX) < 0)
             {
                 fprintf(stderr, "Error rendering audio data\n");
             }
-
-            if (output_subbuffer(subbuf_counter) < 0)
+            if (get_time_ns() - render_start > block_duration)
             {
-                fprintf(stderr, "Error writing audio data\n");
-                available_frames = 0;
-                break;
+                (*deadline_misses)++;
             }
-            else
+
+            written_frames = output_subbuffers(subbuf_counter, 1);
+            if (written_frames < 0)
             {
-                available_frames -= samples_per_call;
+                break;
             }
+            available_frames -= written_frames;
 
             subbuf_counter++;
             if (subbuf_counter == num_subbuffers)
@@ -1604,18 +5400,121 @@ static void main_loop(void)
                 subbuf_counter = 0;
             }
         };
+
+        start_mmap_playback();
     };
+
+    stop_stress_events(input);
+    snd_pcm_drop(midi_pcm);
+}
+
+// lower pcm buffer size until buffer underruns or deadline misses occur, write the smallest stable size to file
+static int probe_latency(void) __attribute__((noinline));
+static int probe_latency(void)
+{
+    midi_input_t *input;
+    unsigned int periods, xruns, deadline_misses, stable_periods, stable_buffer_size;
+    FILE *f;
+
+    input = isolate_clients ? attach_client(0) : &(inputs[0]);
+    if (input == NULL)
+    {
+        fprintf(stderr, "Error attaching probe client\n");
+        return -1;
+    }
+
+    stable_periods = 0;
+    stable_buffer_size = 0;
+    for (periods = num_subbuffers; periods >= 3; periods--)
+    {
+        num_subbuffers = periods;
+        if (open_pcm_output() < 0)
+        {
+            break;
+        }
+
+        run_probe_step(input, &xruns, &deadline_misses);
+
+        printf("Probe: %u periods, buffer %u frames (%.1f ms): %u underruns, %u deadline misses\n",
+            periods,
+            pcm_buffer_size,
+            (pcm_buffer_size * 1000.0) / pcm_rate,
+            xruns,
+            deadline_misses
+        );
+
+        close_pcm_output();
+
+        if (xruns != 0 || deadline_misses != 0)
+        {
+            break;
+        }
+
+        stable_periods = periods;
+        stable_buffer_size = pcm_buffer_size;
+    }
+
+    if (stable_periods == 0)
+    {
+        fprintf(stderr, "No stable pcm configuration found\n");
+        return -2;
+    }
+
+    f = fopen(probe_filepath, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error writing latency file: %s\n", probe_filepath);
+        return -3;
+    }
+
+    fprintf(f, "# %s latency probe: device %s, rate %u, buffer %u frames (%.1f ms)\n",
+        midi_name,
+        pcm_devices[pcm_device_index],
+        pcm_rate,
+        stable_buffer_size,
+        (stable_buffer_size * 1000.0) / pcm_rate
+    );
+    fprintf(f, "periods=%u\n", stable_periods);
+    fclose(f);
+
+    printf("Smallest stable pcm buffer: %u periods (%u frames), written to %s\n", stable_periods, stable_buffer_size, probe_filepath);
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
     read_arguments(argc, argv);
 
+    select_monotonic_clock();
+
+    if (latency_filepath != NULL && latency_ms < 0 && latency_periods < 0)
+    {
+        load_latency_file();
+    }
+
     if (start_synth() < 0)
     {
         return 2;
     }
 
+    if (probe_filepath != NULL)
+    {
+        // probe runs in render thread, main thread waits until it's finished
+        if (start_thread() < 0)
+        {
+            stop_synth();
+            return 4;
+        }
+
+        midi_init_state = 1;
+
+        wait_for_signals();
+
+        stop_synth();
+        return (probe_result < 0) ? 7 : 0;
+    }
+
     if (daemonize)
     {
         if (run_as_daemon() < 0)
@@ -1646,7 +5545,10 @@ int main(int argc, char *argv[])
         return 6;
     }
 
-    main_loop();
+    // start processing midi events and rendering audio in threads
+    midi_init_state = 1;
+
+    wait_for_signals();
 
     midi_init_state = -1;
     close_midi_port();